@@ -1,45 +1,357 @@
-#include <functional>
 #include <ESP8266WiFi.h>
 #include <WiFiManager.h>
-#include <ESP8266HTTPClient.h>
+#include <WiFiUdp.h>
 #include <EEPROM.h>
 
+extern "C" {
+#include <gpio.h>
+}
+
 #define EEPROM_SIZE     512
 #define ADDR_URL        0
 #define ADDR_APIKEY     200
 #define ADDR_GCODE      300
 #define ADDR_TYPE       400
+#define ADDR_PROFILE    420
+#define ADDR_KASA_ID    440
 
 #define BUTTON_PIN      2
 #define LED_PIN         0
 #define LED_ON          LOW
 #define LED_OFF         HIGH
 
+// Optional extra inputs (GPIO 0-15, wired to GND with the internal pull-up).
+// Define PAUSE_PIN for a soft pause/cancel button, DOOR_PIN for a door
+// interlock switch that closes when the door is shut, and CONFIG_PIN for a
+// button that opens the web config page when held.
+// #define PAUSE_PIN    4
+// #define DOOR_PIN     5
+// #define CONFIG_PIN   12
+
 #define DEBOUNCE_MS     50
+#define SCAN_INTERVAL_MS (DEBOUNCE_MS / 4)  // Vertical counter needs 4 stable samples
+#define LONG_PRESS_MS   1500
 #define RESET_HOLD_MS   3000
+#define CONFIG_PAGE_TIMEOUT_MS 300000  // Close the on-demand config page after 5 minutes
+#define CONFIG_PORTAL_TIMEOUT_S 180    // Give up on the captive portal, retry the saved network
+#define CLEAR_KEY_VALUE "-"            // Typed into the key field to clear the stored key
+
+// Actions an input can trigger; each has its own prepared payload
+#define ACTION_STOP     0
+#define ACTION_PAUSE    1
+#define ACTION_CANCEL   2
+#define ACTION_COUNT    3
+#define ACTION_CONFIG   0xFE    // Local: open the web config page
+#define ACTION_NONE     0xFF
+
+// Fixed-size arenas for the press path. Sized at compile time so that a
+// press never needs a heap block, no matter how fragmented the heap gets.
+#define REQUEST_ARENA_SIZE    768   // Prepared wire bytes (HTTP request or Kasa frame)
+#define RESPONSE_ARENA_SIZE   2560  // Largest reply we keep (Kasa get_sysinfo of a strip)
+#define KASA_JSON_SIZE        192   // One Kasa JSON request
+#define KASA_FRAME_SIZE       (KASA_JSON_SIZE + 4)
+#define KASA_MAX_CHILDREN     8
+#define KASA_ID_LEN           48
+#define KASA_PORT             9999
+#define KASA_DISCOVERY_MAX    8      // Devices cached per discovery round
+#define KASA_DISCOVERY_WINDOW_MS   1000
+#define KASA_DISCOVERY_INTERVAL_MS 60000
+
+#define RAW_PORT              23     // Typical ser2net / printer telnet port
+#define RAW_WAIT_FOR_OK       1      // Set to 0 for bridges that never answer
+#define MQTT_PORT             1883
+#define MQTT_KEEPALIVE_S      30
+#define MQTT_CONNECT_SIZE     320
+
+#define NET_TIMEOUT_MS        3000
+#define TELEMETRY_INTERVAL_MS 60000
+#define RECONNECT_INTERVAL_MS 5000
+
+// Press journal in RTC user memory (survives watchdog and software resets,
+// not power loss). The last 128 bytes of RTC user memory belong to OTA.
+#define JOURNAL_RTC_OFFSET    0
+#define JOURNAL_MAGIC         0x45535450  // "ESTP"
+#define JOURNAL_SLOTS         16
+#define JOURNAL_MAX_ATTEMPTS  10
+#define JOURNAL_RETRY_MS      1000        // Doubles per failed attempt, up to 16x
+#define COALESCE_MS           2000
+
+// Power profiles, selected by the "profile" config field
+#define PROFILE_BALANCED      0   // Default modem sleep, connect per press
+#define PROFILE_LATENCY       1   // Radio always on, warm socket to the target
+#define PROFILE_BATTERY       2   // Light sleep while associated, woken by BUTTON_PIN
+#define WARM_RETRY_MS         10000
+#define BATTERY_POLL_MS       1000  // Idle delay; the other inputs are sampled this often
+#define LIGHT_SLEEP_INTERVAL  3     // Wake for every 3rd DTIM beacon in light sleep
+
+// ESP8266EX datasheet supply currents, used for the average current
+// estimate (the module cannot measure its own current)
+#define ACTIVE_CURRENT_MA     80
+#define LIGHT_SLEEP_CURRENT_UA 900
+
+// Kasa outlet addressing methods, tried in order for the KP200 second outlet
+#define KASA_BY_CHILD_ID      0
+#define KASA_BY_DERIVED_ID    1
+#define KASA_BY_CHILD_INDEX   2
+#define KASA_BY_OUTLET_PARAM  3
+
+// One physical input and what it does on press, short release and long hold
+struct InputConfig {
+  uint8_t pin;
+  bool activeLow;        // true: active when pulled to GND
+  uint8_t pressAction;   // Fired on the debounced press edge
+  uint8_t shortAction;   // Fired on release if held less than LONG_PRESS_MS
+  uint8_t longAction;    // Fired once when held for LONG_PRESS_MS
+  const char* name;
+};
+
+static const InputConfig inputs[] = {
+  { BUTTON_PIN, true,  ACTION_STOP, ACTION_NONE,  ACTION_NONE,   "Stop" },
+#ifdef PAUSE_PIN
+  { PAUSE_PIN,  true,  ACTION_NONE, ACTION_PAUSE, ACTION_CANCEL, "Pause" },
+#endif
+#ifdef DOOR_PIN
+  // Switch opens (reads HIGH) when the door does
+  { DOOR_PIN,   false, ACTION_STOP, ACTION_NONE,  ACTION_NONE,   "Door" },
+#endif
+#ifdef CONFIG_PIN
+  { CONFIG_PIN, true,  ACTION_NONE, ACTION_NONE,  ACTION_CONFIG, "Config" },
+#endif
+};
+#define INPUT_COUNT (sizeof(inputs) / sizeof(inputs[0]))
+
+static const char* const actionNames[ACTION_COUNT] = { "stop", "pause", "cancel" };
+static const char* const profileNames[] = { "balanced", "latency", "battery" };
+// Awake but idle: modem sleep, radio always on, modem sleep (battery spends
+// its idle delays in light sleep, counted separately)
+static const uint8_t profileIdleCurrentMa[] = { 15, 70, 15 };
+
+String baseURL, apiKey, gcode, serverType, profileName;
+unsigned long lastTelemetryTime = 0;
+bool wifiWasConnected = false;
+bool configRequested = false;
+bool configSaved = false;
+unsigned long configPageOpenedAt = 0;
+char serialLine[16];
+size_t serialLineLength = 0;
+
+// WiFiManager runs non-blocking from loop(), so the inputs stay armed while
+// the captive portal or the on-demand web config page is up
+WiFiManager wm;
+WiFiManagerParameter param_url("octourl", "Base URL, Kasa IP or mqtt://broker/topic", "", 200);
+WiFiManagerParameter param_key("apikey", "API Key, MQTT user:password (unused for Kasa; blank keeps the current one, - clears it)", "", 100);
+WiFiManagerParameter param_gcode("gcode", "GCODE or Kasa Action (on/off/on0/off1)", "M112", 100);
+WiFiManagerParameter param_type("type", "Server Type (octo/moon/kasa/mqtt/raw)", "octo", 20);
+WiFiManagerParameter param_profile("profile", "Power Profile (balanced/latency/battery)", "balanced", 20);
+
+// One accepted press waiting for delivery
+struct JournalEntry {
+  uint32_t seq;
+  uint32_t detectedAt;  // millis() at the press; 0 once it no longer times wake-to-ack
+  uint32_t lastTry;     // millis() of the last failed attempt, for the backoff
+  uint8_t action;
+  uint8_t attempts;
+  uint16_t reserved;
+};
+
+// Sequence-numbered ring of pending presses plus delivery counters; the
+// whole struct is mirrored to RTC memory after every change
+struct PressJournal {
+  uint32_t magic;
+  uint32_t nextSeq;
+  uint32_t delivered;
+  uint32_t lost;
+  uint32_t coalesced;
+  uint8_t head;
+  uint8_t count;
+  uint16_t reserved;
+  JournalEntry entries[JOURNAL_SLOTS];
+  uint32_t checksum;
+};
+
+static PressJournal journal;
+static unsigned long lastAccepted[ACTION_COUNT];
+static unsigned long lastReconnectAttempt = 0;
+
+// Status LED blink, stepped from loop() so a send never stalls input scanning
+static uint8_t ledPhasesLeft = 0;
+static unsigned long ledPhaseMs = 0;
+static unsigned long ledLastToggle = 0;
+
+// Power profile and wake-to-ack statistics
+static int powerProfile = PROFILE_BALANCED;
+static WiFiClient netClient;
+static unsigned long lastWarmAttempt = 0;
+static unsigned long activityStart = 0;
+static unsigned long pressDetectedAt = 0;
+static bool sendRejected = false;  // The last send failed in a way a retry can't fix
+static unsigned long activeMs = 0;
+static unsigned long sleepMs = 0;      // Time in the battery profile's idle delay
+static unsigned long profileStart = 0; // The statistics cover the current profile only
+static volatile unsigned long wakeAt = 0;
+static uint32_t ackCount = 0;
+static unsigned long ackLatencyLast = 0, ackLatencyMax = 0, ackLatencySum = 0;
+
+// Input scanner state: one bit per GPIO, all inputs debounced together
+static uint16_t inputMask = 0;
+static uint16_t activeLowMask = 0;
+static uint16_t debouncedState = 0;
+static uint16_t vcount0 = 0, vcount1 = 0;
+static uint16_t longFired = 0;
+static uint8_t inputIndexForPin[16];
+static unsigned long pressStart[INPUT_COUNT];
+static unsigned long lastScanTime = 0;
+
+// Press path buffers, one prepared payload per action
+static uint8_t requestArena[ACTION_COUNT][REQUEST_ARENA_SIZE];
+static size_t requestLength[ACTION_COUNT];
+static bool commandPrepared[ACTION_COUNT];
+static char responseArena[RESPONSE_ARENA_SIZE];
+static char kasaJson[KASA_JSON_SIZE];
+static uint8_t kasaFrame[KASA_FRAME_SIZE];
+
+// HTTP or MQTT target, parsed once from baseURL
+static char targetHost[64];
+static uint16_t targetPort = 80;
+static char targetPath[64];
+
+// Kasa device state, filled from get_sysinfo
+static char kasaDeviceId[KASA_ID_LEN];
+static char kasaChildIds[KASA_MAX_CHILDREN][KASA_ID_LEN];
+static int kasaNumChildren = 0;
+static char kasaModel[32];
+static int kasaOutlet = 0;
+static bool kasaTurnOn = true;
+static bool kasaSpecialOutlet = false;
+static int kasaPreparedMethod = KASA_BY_CHILD_ID;
+
+// MQTT session: CONNECT (with last-will) is pre-built, PUBLISH packets live in
+// requestArena with their packet id patched in on each press
+static uint8_t mqttConnectPacket[MQTT_CONNECT_SIZE];
+static size_t mqttConnectLength = 0;
+static size_t mqttIdOffset[ACTION_COUNT];
+static char mqttStatusTopic[80];
+static uint16_t mqttPacketId = 0;
+static bool mqttSession = false;
+static unsigned long mqttLastSend = 0;
+
+// Device id of the configured plug, persisted so it can be found again by
+// UDP discovery when DHCP moves it to a new address
+static char kasaKnownId[KASA_ID_LEN];
+
+// One device that answered the discovery broadcast
+struct KasaDevice {
+  char deviceId[KASA_ID_LEN];
+  char mac[18];
+  char model[32];
+  char ip[16];
+};
+
+static WiFiUDP kasaUdp;
+static KasaDevice kasaDevices[KASA_DISCOVERY_MAX];
+static int kasaDeviceCount = 0;
+static bool kasaDiscoveryActive = false;
+static bool kasaDiscoveryRequested = false;
+static unsigned long kasaDiscoveryStart = 0;
+static unsigned long lastKasaDiscovery = 0;
+
+#ifdef ESTOP_ALLOC_TRACE
+// Counting allocator hook. The esp8266_alloctrace environment links with
+// --wrap=malloc/realloc/calloc so every heap allocation passes through here.
+extern "C" {
+  void* __real_malloc(size_t size);
+  void* __real_realloc(void* ptr, size_t size);
+  void* __real_calloc(size_t count, size_t size);
+  volatile uint32_t allocCount = 0;
+
+  void* __wrap_malloc(size_t size) {
+    allocCount++;
+    return __real_malloc(size);
+  }
 
-String baseURL, apiKey, gcode, serverType;
-unsigned long lastDebounceTime = 0;
-bool lastButtonState = HIGH;
-bool buttonPressed = false;
+  void* __wrap_realloc(void* ptr, size_t size) {
+    allocCount++;
+    return __real_realloc(ptr, size);
+  }
+
+  void* __wrap_calloc(size_t count, size_t size) {
+    allocCount++;
+    return __real_calloc(count, size);
+  }
+}
+#endif
 
 // Function declarations
-bool sendRawKasaCommand(const String& ip, const String& json, bool infoOnly = false);
-bool sendJsonAndGetResponse(WiFiClient& client, const String& ip, int port, const String& json, 
-                          std::function<void(const String&)> responseProcessor);
-bool sendKasaCommand(const String& command);
-bool sendOctoPrintCommand(const String& gcode);
-bool sendMoonrakerCommand(const String& gcode);
-void sendCommand();
+bool prepareCommand();
+bool prepareHttpCommand(int action, const char* path, const char* body, bool bearer);
+bool prepareKasaCommand();
+bool parseBaseURL(const char* url, uint16_t defaultPort);
+size_t readFully(WiFiClient& client, uint8_t* buffer, size_t len, unsigned long timeoutMs);
+size_t kasaEncrypt(const char* json, uint8_t* frame, size_t frameSize);
+int kasaExchange(const char* ip, const uint8_t* frame, size_t frameLength);
+bool sendKasaFrame(const uint8_t* frame, size_t frameLength);
+int buildKasaRelayJson(int method);
+bool sendKasaCommand();
+bool sendHttpCommand(const char* label, int action, bool acceptNoContent);
+int readHttpResponse(bool& reusable);
+bool sendOctoPrintCommand(int action);
+bool sendMoonrakerCommand(int action);
+bool prepareRawCommand();
+bool waitForRawAck();
+bool sendRawCommand(int action);
+size_t mqttPutString(uint8_t* out, const char* str, size_t len);
+size_t mqttFinish(uint8_t* packet, uint8_t type, size_t bodyLength);
+int mqttReadPacket();
+bool prepareMqttCommand();
+bool mqttConnect();
+bool sendMqttCommand(int action);
+void mqttTick();
+bool sendCommand(int action, unsigned long detectedAt);
+uint32_t journalChecksum();
+void loadJournal();
+void saveJournal();
+JournalEntry& journalEntry(uint8_t index);
+void removeJournalEntry(uint8_t index);
+void journalPress(uint8_t action);
+void drainJournal();
+bool journalEntryDue(const JournalEntry& entry);
+void startBlink(uint8_t count, unsigned long phaseMs);
+void ledTick();
+void initInputs();
+void scanInputs();
+void runAction(uint8_t action, const InputConfig& input);
+bool inputsIdle();
+void batterySleep();
+void onButtonWake();
+void applyPowerProfile();
+bool connectTarget(const char* host, uint16_t port, bool& reused);
+void releaseTarget(bool reusable);
+bool keepConnectionOpen();
+void keepWarm();
 void checkReset();
-void saveConfig(const String& url, const String& key, const String& code, const String& type);
+void saveConfig(const String& url, const String& key, const String& code, const String& type,
+                const String& profile);
 void loadConfig();
-void parseKasaCommand(const String& command, int& outletNum, bool& turnOn);
+void applyConfig();
+void openConfigPage();
+void closeConfigPage();
+void pollSerialCommand();
+void refreshConfigParams();
+void parseKasaCommand(const char* command, int& outletNum, bool& turnOn);
 void dumpHex(const uint8_t* buffer, size_t len);
-bool getKasaDeviceInfo(const String& ip, String& deviceId, String childIds[], int& numChildren);
+bool extractJsonString(const char* src, const char* key, char* out, size_t outSize);
+bool getKasaDeviceInfo(const char* ip);
+void kasaDecrypt(char* buffer, size_t len);
+void saveKasaLocation(const char* ip);
+void startKasaDiscovery();
+void pollKasaDiscovery();
+void finishKasaDiscovery();
+void kasaDiscoveryTick();
+void printHeapTelemetry();
 
 // Save configuration to EEPROM
-void saveConfig(const String& url, const String& key, const String& code, const String& type) {
+void saveConfig(const String& url, const String& key, const String& code, const String& type,
+                const String& profile) {
   EEPROM.begin(EEPROM_SIZE);
   
   // Clear the EEPROM sections first
@@ -47,7 +359,14 @@ void saveConfig(const String& url, const String& key, const String& code, const
   for (int i = 0; i < 100; i++) EEPROM.write(ADDR_APIKEY + i, 0);
   for (int i = 0; i < 100; i++) EEPROM.write(ADDR_GCODE + i, 0);
   for (int i = 0; i < 20; i++) EEPROM.write(ADDR_TYPE + i, 0);
+  for (int i = 0; i < 20; i++) EEPROM.write(ADDR_PROFILE + i, 0);
   
+  // A new target address means a different device; forget the old id
+  if (url != baseURL) {
+    for (int i = 0; i < KASA_ID_LEN; i++) EEPROM.write(ADDR_KASA_ID + i, 0);
+    kasaKnownId[0] = 0;
+  }
+
   // Write the new values
   for (unsigned int i = 0; i < url.length(); i++) 
     EEPROM.write(ADDR_URL + i, url[i]);
@@ -61,6 +380,9 @@ void saveConfig(const String& url, const String& key, const String& code, const
   for (unsigned int i = 0; i < type.length(); i++) 
     EEPROM.write(ADDR_TYPE + i, type[i]);
   
+  for (unsigned int i = 0; i < profile.length(); i++) 
+    EEPROM.write(ADDR_PROFILE + i, profile[i]);
+
   EEPROM.commit();
   Serial.println("Config saved successfully");
 }
@@ -72,7 +394,8 @@ void loadConfig() {
   char key[100] = {0};
   char code[100] = {0};
   char type[20] = {0};
-  
+  char profile[20] = {0};
+
   for (int i = 0; i < 199; i++) {
     url[i] = EEPROM.read(ADDR_URL + i);
     if (url[i] == 0) break;
@@ -93,45 +416,148 @@ void loadConfig() {
     if (type[i] == 0) break;
   }
   
+  for (int i = 0; i < 19; i++) {
+    profile[i] = EEPROM.read(ADDR_PROFILE + i);
+    if (profile[i] == 0) break;
+  }
+  
+  memset(kasaKnownId, 0, sizeof(kasaKnownId));
+  for (int i = 0; i < KASA_ID_LEN - 1; i++) {
+    kasaKnownId[i] = EEPROM.read(ADDR_KASA_ID + i);
+    if (kasaKnownId[i] == 0) break;
+  }
+
   baseURL = String(url);
   apiKey = String(key);
   gcode = String(code);
   serverType = String(type);
-  
+  profileName = String(profile);
+
   Serial.println("Loaded configuration:");
   Serial.println("URL: " + baseURL);
   Serial.print("API Key: ");
   Serial.println(apiKey.isEmpty() ? "[empty]" : "[set]");
   Serial.println("GCODE/Command: " + gcode);
   Serial.println("Server Type: " + serverType);
+  Serial.println("Power Profile: " + profileName);
+}
+
+// Store the portal's values and switch to them in place: no reboot, and
+// the inputs stay armed throughout
+void applyConfig() {
+  Serial.println("WiFiManager params saved");
+  
+  // The stored key is never sent back to the form, so blank means unchanged
+  // and CLEAR_KEY_VALUE removes it (e.g. moving to a broker without auth)
+  const char* key = param_key.getValue();
+  String newKey = apiKey;
+  if (strcmp(key, CLEAR_KEY_VALUE) == 0) {
+    newKey = "";
+  } else if (key[0]) {
+    newKey = key;
+  }
+  saveConfig(
+    param_url.getValue(),
+    newKey,
+    param_gcode.getValue(),
+    param_type.getValue(),
+    param_profile.getValue()
+  );
+  
+  loadConfig();
+  applyPowerProfile();
+  if (WiFi.status() == WL_CONNECTED) {
+    prepareCommand();
+  }
+  
+  // Still inside the web server's request handler; loop() closes the page
+  configSaved = true;
+}
+
+// Load the form fields from the live config. Discovery can move the Kasa
+// plug at runtime, and a stale field would write the old address back.
+void refreshConfigParams() {
+  param_url.setValue(baseURL.c_str(), 200);
+  param_key.setValue("", 100);
+  if (!gcode.isEmpty()) {
+    param_gcode.setValue(gcode.c_str(), 100);
+  }
+  if (!serverType.isEmpty()) {
+    param_type.setValue(serverType.c_str(), 20);
+  }
+  if (!profileName.isEmpty()) {
+    param_profile.setValue(profileName.c_str(), 20);
+  }
+}
+
+// Serve the config pages on the station IP while staying connected and armed.
+// The page has no login, so it only opens on request and closes after a
+// save or CONFIG_PAGE_TIMEOUT_MS.
+void openConfigPage() {
+  if (WiFi.status() != WL_CONNECTED || wm.getWebPortalActive()) return;
+  
+  // The fields get their own "Setup" page here, away from the WiFi scan.
+  // The captive portal keeps them on the WiFi page for first-time setup.
+  const char* menu[] = { "param", "info", "exit" };
+  wm.setMenu(menu, 3);
+  
+  refreshConfigParams();
+  wm.startWebPortal();
+  configPageOpenedAt = millis();
+  configSaved = false;
+  Serial.print("Config page open at http://");
+  Serial.println(WiFi.localIP());
+}
+
+void closeConfigPage() {
+  wm.stopWebPortal();
+  configSaved = false;
+  Serial.println("Config page closed");
+}
+
+// Serial console commands, one per line: "config" opens the config page
+// without touching any input
+void pollSerialCommand() {
+  while (Serial.available() > 0) {
+    char c = Serial.read();
+    if (c != '\r' && c != '\n') {
+      if (serialLineLength < sizeof(serialLine) - 1) serialLine[serialLineLength++] = c;
+      continue;
+    }
+    
+    serialLine[serialLineLength] = 0;
+    if (strcasecmp(serialLine, "config") == 0) {
+      if (WiFi.status() == WL_CONNECTED) {
+        openConfigPage();
+      } else {
+        Serial.println("Config page will open once connected");
+        configRequested = true;
+      }
+    } else if (serialLineLength > 0) {
+      Serial.println("Unknown command. Available: config");
+    }
+    serialLineLength = 0;
+  }
 }
 
 // Parse Kasa command to extract outlet number and action
-void parseKasaCommand(const String& command, int& outletNum, bool& turnOn) {
+void parseKasaCommand(const char* command, int& outletNum, bool& turnOn) {
   // Default values
   outletNum = 0;
   turnOn = true;
   
-  // Convert to lowercase for consistent behavior
-  String lowerCmd = command;
-  lowerCmd.toLowerCase();
-  
-  // Look for format like "on0", "off1", etc.
-  if (lowerCmd.startsWith("on")) {
+  // Look for format like "on0", "off1", etc. (case-insensitive)
+  if (strncasecmp(command, "on", 2) == 0) {
     turnOn = true;
-    if (lowerCmd.length() > 2) {
-      outletNum = lowerCmd.substring(2).toInt();
-    }
+    outletNum = atoi(command + 2);
   } 
-  else if (lowerCmd.startsWith("off")) {
+  else if (strncasecmp(command, "off", 3) == 0) {
     turnOn = false;
-    if (lowerCmd.length() > 3) {
-      outletNum = lowerCmd.substring(3).toInt();
-    }
+    outletNum = atoi(command + 3);
   }
   // If just a number is provided, assume it's the outlet number (turn on)
-  else if (lowerCmd.toInt() || lowerCmd == "0") {
-    outletNum = lowerCmd.toInt();
+  else if (isdigit((unsigned char)command[0])) {
+    outletNum = atoi(command);
     turnOn = true;
   }
   
@@ -152,557 +578,1511 @@ void dumpHex(const uint8_t* buffer, size_t len) {
   Serial.println();
 }
 
-// Get information from the Kasa device including device ID and child IDs
-bool getKasaDeviceInfo(const String& ip, String& deviceId, String childIds[], int& numChildren) {
-  WiFiClient client;
-  const int kasaPort = 9999;
-  bool success = false;
-  
-  // Initialize return values
-  deviceId = "";
-  numChildren = 0;
-  
-  if (!client.connect(ip.c_str(), kasaPort)) {
-    Serial.println("Failed to connect to Kasa device for info query");
-    return false;
+// Print heap health so fragmentation can be tracked over long uptimes,
+// plus the active profile's wake-to-ack latency and estimated current
+void printHeapTelemetry() {
+  Serial.print("Heap free: ");
+  Serial.print(ESP.getFreeHeap());
+  Serial.print(" max block: ");
+  Serial.print(ESP.getMaxFreeBlockSize());
+  Serial.print(" fragmentation: ");
+  Serial.print(ESP.getHeapFragmentation());
+  Serial.println("%");
+  
+  Serial.print("Profile: ");
+  Serial.print(profileNames[powerProfile]);
+  Serial.print(" ack latency last/avg/max: ");
+  Serial.print(ackLatencyLast);
+  Serial.print("/");
+  Serial.print(ackCount ? ackLatencySum / ackCount : 0);
+  Serial.print("/");
+  Serial.print(ackLatencyMax);
+  Serial.print(" ms over ");
+  Serial.print(ackCount);
+  Serial.print(" presses, est. avg current: ");
+  
+  // Time-weighted estimate since the profile was applied: active (sending)
+  // time at ACTIVE_CURRENT_MA, idle delays in light sleep at
+  // LIGHT_SLEEP_CURRENT_UA (a floor: beacon wake-ups add to it), the rest
+  // at the profile's awake idle current
+  unsigned long uptime = millis() - profileStart;
+  unsigned long idleMs = uptime > activeMs + sleepMs ? uptime - activeMs - sleepMs : 0;
+  float avgMa = uptime ? (activeMs * (float)ACTIVE_CURRENT_MA +
+                          sleepMs * (LIGHT_SLEEP_CURRENT_UA / 1000.0f) +
+                          idleMs * (float)profileIdleCurrentMa[powerProfile]) / uptime : 0;
+  Serial.print(avgMa, 1);
+  Serial.println(" mA");
+  
+  Serial.print("Journal pending: ");
+  Serial.print(journal.count);
+  Serial.print(" delivered: ");
+  Serial.print(journal.delivered);
+  Serial.print(" lost: ");
+  Serial.print(journal.lost);
+  Serial.print(" coalesced: ");
+  Serial.println(journal.coalesced);
+}
+
+// Set the WiFi sleep mode for the configured power profile
+void applyPowerProfile() {
+  int previousProfile = powerProfile;
+  powerProfile = PROFILE_BALANCED;
+  if (profileName.equalsIgnoreCase("latency")) {
+    powerProfile = PROFILE_LATENCY;
+  } else if (profileName.equalsIgnoreCase("battery")) {
+    powerProfile = PROFILE_BATTERY;
   }
   
-  String infoJson = "{\"system\":{\"get_sysinfo\":{}}}";
-  Serial.println("Getting device info...");
-  
-  // Encrypt and send the info query
-  size_t infoJsonLength = infoJson.length();
-  uint8_t* encrypted = new uint8_t[infoJsonLength];
-  uint8_t key = 0xAB;
+  netClient.stop();
+  gpio_pin_wakeup_disable();
   
-  for (size_t i = 0; i < infoJsonLength; i++) {
-    encrypted[i] = infoJson.charAt(i) ^ key;
-    key = encrypted[i];
-  }
-  
-  uint8_t header[4] = {
-    (uint8_t)((infoJsonLength >> 24) & 0xFF),
-    (uint8_t)((infoJsonLength >> 16) & 0xFF),
-    (uint8_t)((infoJsonLength >> 8) & 0xFF),
-    (uint8_t)(infoJsonLength & 0xFF)
-  };
-  
-  client.write(header, 4);
-  client.write(encrypted, infoJsonLength);
-  client.flush();
-  delete[] encrypted;
-  
-  // Wait for response
-  unsigned long timeout = millis() + 3000;
-  while (client.available() == 0) {
-    if (millis() > timeout) {
-      Serial.println("Info query timeout");
-      client.stop();
-      return false;
-    }
-    delay(10);
+  // Latency and current figures are per profile; start them afresh
+  if (powerProfile != previousProfile) {
+    ackCount = 0;
+    ackLatencyLast = ackLatencyMax = ackLatencySum = 0;
+    activeMs = sleepMs = 0;
+    profileStart = millis();
   }
   
-  // Process response
-  if (client.available()) {
-    // Skip length header
-    for (int i = 0; i < 4 && client.available(); i++) {
-      client.read();
-    }
-    
-    // Decrypt response
-    String response = "";
-    uint8_t decryptKey = 0xAB;
-    while (client.available()) {
-      uint8_t c = client.read();
-      uint8_t decrypted = c ^ decryptKey;
-      decryptKey = c;
-      response += (char)decrypted;
-    }
-    
-    Serial.println("Device info response received");
-    
-    // Extract main device ID
-    int deviceIdPos = response.indexOf("\"deviceId\":\"");
-    if (deviceIdPos > 0) {
-      deviceIdPos += 12; // Skip over "deviceId":"
-      int deviceIdEnd = response.indexOf("\"", deviceIdPos);
-      if (deviceIdEnd > deviceIdPos) {
-        deviceId = response.substring(deviceIdPos, deviceIdEnd);
-        Serial.print("Device ID: ");
-        Serial.println(deviceId);
-      }
-    }
-    
-    // Look for the children array
-    int childrenStart = response.indexOf("\"children\":[");
-    if (childrenStart > 0) {
-      // Navigate through the children array to extract each child's ID
-      int index = childrenStart + 12; // Skip over "children":[ 
-      int braceCount = 0;
-      int childIndex = 0;
-      
-      // Process each child object
-      while (index < response.length() && childIndex < 8) { // Maximum of 8 children
-        if (response.charAt(index) == '{') {
-          braceCount++;
-          
-          // Look for id within this child object
-          int idPos = response.indexOf("\"id\":\"", index);
-          if (idPos > 0 && braceCount == 1) {
-            idPos += 6; // Skip over "id":"
-            int idEnd = response.indexOf("\"", idPos);
-            if (idEnd > idPos) {
-              childIds[childIndex] = response.substring(idPos, idEnd);
-              Serial.print("Child ");
-              Serial.print(childIndex);
-              Serial.print(" ID: ");
-              Serial.println(childIds[childIndex]);
-              childIndex++;
-            }
-          }
-        } 
-        else if (response.charAt(index) == '}') {
-          braceCount--;
-        }
-        
-        index++;
-        
-        // If we've completed a child object, check if we're at the end of the array
-        if (braceCount == 0 && index < response.length()) {
-          if (response.charAt(index) == ']') {
-            break; // End of children array
-          }
-        }
-      }
-      
-      numChildren = childIndex;
-      Serial.print("Found ");
-      Serial.print(numChildren);
-      Serial.println(" children");
-      success = (numChildren > 0);
-    }
+  switch (powerProfile) {
+    case PROFILE_LATENCY:
+      WiFi.setSleepMode(WIFI_NONE_SLEEP);
+      break;
+    case PROFILE_BATTERY:
+      // Automatic light sleep while idle in delay(), staying associated so
+      // a press goes out on the existing connection
+      WiFi.setSleepMode(WIFI_LIGHT_SLEEP, LIGHT_SLEEP_INTERVAL);
+      break;
+    default:
+      WiFi.setSleepMode(WIFI_MODEM_SLEEP);
+      break;
   }
   
-  client.stop();
-  return success;
+  Serial.print("Power profile: ");
+  Serial.println(profileNames[powerProfile]);
 }
 
-// Send command to the specific outlet of a TP-Link Kasa device
-bool sendKasaCommand(const String& command) {
-  // Parse the command to determine outlet number and action
-  int outletNum;
-  bool turnOn;
-  parseKasaCommand(command, outletNum, turnOn);
-  
-  // Get device info including child IDs
-  String deviceId;
-  String childIds[8]; // Support up to 8 outlets
-  int numChildren;
-  bool isKP200 = false;
-  String modelName = "";
-  
-  // Query the device for its information
-  if (getKasaDeviceInfo(baseURL, deviceId, childIds, numChildren)) {
-    // If we have outlet 1 requested but only one child found, it might be a KP200
-    // even if we can't confirm from the model name
-    if (outletNum == 1 && numChildren <= 1) {
-      // First, try to get model info
-      WiFiClient infoClient;
-      String infoJson = "{\"system\":{\"get_sysinfo\":{}}}";
-      
-      if (sendJsonAndGetResponse(infoClient, baseURL, 9999, infoJson, [&](const String& response) {
-        // Extract model name from response
-        int modelPos = response.indexOf("\"model\":\"");
-        if (modelPos > 0) {
-          modelPos += 9; // Skip "model":"
-          int modelEnd = response.indexOf("\"", modelPos);
-          if (modelEnd > modelPos) {
-            modelName = response.substring(modelPos, modelEnd);
-            Serial.print("Device model: ");
-            Serial.println(modelName);
-            
-            // Check if it's a KP200 model
-            if (modelName.indexOf("KP200") >= 0) {
-              isKP200 = true;
-              Serial.println("Detected KP200 model - enabling special dual-outlet handling");
-            }
-          }
-        }
-      })) {
-        // Successfully got device info
-      }
-      
-      // If model detection failed but we have outlet 1 requested with only 1 child,
-      // assume it might be a KP200 and try special handling
-      if (!isKP200 && outletNum == 1 && numChildren <= 1) {
-        Serial.println("Outlet 1 requested but only 1 child found - trying special handling");
-        isKP200 = true;
-      }
-      
-      // For KP200, try the special methods for second outlet
-      if (isKP200 && outletNum == 1) {
-        Serial.println("Using special handling for KP200 second outlet");
-        
-        // Method 1: Try derived child ID
-        if (!childIds[0].isEmpty() && childIds[0].length() >= 2) {
-          String secondOutletId = childIds[0].substring(0, childIds[0].length()-2) + "01";
-          
-          Serial.print("Trying second outlet with derived ID: ");
-          Serial.println(secondOutletId);
-          
-          String json = "{\"context\":{\"child_ids\":[\"" + secondOutletId + 
-                       "\"]},\"system\":{\"set_relay_state\":{\"state\":" + 
-                       String(turnOn ? 1 : 0) + "}}}";
-          
-          if (sendRawKasaCommand(baseURL, json, false)) {
-            return true;
-          }
-        }
-        
-        // Method 2: Try numeric index
-        Serial.println("Trying second outlet with numeric index");
-        String json = "{\"context\":{\"child_ids\":[1]},\"system\":{\"set_relay_state\":{\"state\":" + 
-                     String(turnOn ? 1 : 0) + "}}}";
-        
-        if (sendRawKasaCommand(baseURL, json, false)) {
-          return true;
-        }
-        
-        // Method 3: Try outlet parameter
-        Serial.println("Trying second outlet with outlet parameter");
-        json = "{\"system\":{\"set_relay_state\":{\"state\":" + String(turnOn ? 1 : 0) + 
-               ",\"outlet\":1}}}";
-        
-        if (sendRawKasaCommand(baseURL, json, false)) {
-          return true;
-        }
-        
-        Serial.println("All methods failed for second outlet");
-        return false;
-      }
-    }
-    
-    // Normal handling for non-KP200 devices or outlet 0 of KP200
-    if (outletNum >= numChildren) {
-      Serial.print("Error: Outlet ");
-      Serial.print(outletNum);
-      Serial.print(" requested but device only has ");
-      Serial.print(numChildren);
-      Serial.println(" outlets");
-      return false;
+// Warm sockets are kept in the latency profile, and always for the raw TCP
+// bridge (ser2net typically accepts a single client at a time)
+bool keepConnectionOpen() {
+  return powerProfile == PROFILE_LATENCY || serverType.equalsIgnoreCase("raw");
+}
+
+// Open the connection to the target, reusing the warm socket when one is kept
+bool connectTarget(const char* host, uint16_t port, bool& reused) {
+  reused = false;
+  if (netClient.connected()) {
+    if (keepConnectionOpen()) {
+      reused = true;
+      return true;
     }
-    
-    // Send command to regular outlet
-    String json = "{\"context\":{\"child_ids\":[\"" + childIds[outletNum] + 
-                 "\"]},\"system\":{\"set_relay_state\":{\"state\":" + 
-                 String(turnOn ? 1 : 0) + "}}}";
-    
-    Serial.print("Sending command to outlet ");
-    Serial.print(outletNum);
-    Serial.print(": ");
-    Serial.println(json);
-    
-    return sendRawKasaCommand(baseURL, json, false);
-  } else {
-    Serial.println("Failed to get device info");
+    netClient.stop();
+  }
+  
+  if (!netClient.connect(host, port)) {
     return false;
   }
+  netClient.setNoDelay(true);
+  if (keepConnectionOpen()) {
+    netClient.keepAlive();
+  }
+  return true;
 }
 
-// Helper function to send JSON and process response
-bool sendJsonAndGetResponse(WiFiClient& client, const String& ip, int port, const String& json, 
-                          std::function<void(const String&)> responseProcessor) {
-  if (!client.connect(ip.c_str(), port)) {
-    Serial.println("Failed to connect to device");
-    return false;
+// Close the connection unless it is kept warm and still in sync
+void releaseTarget(bool reusable) {
+  if (!keepConnectionOpen() || !reusable) {
+    netClient.stop();
   }
-  
-  // Encrypt and send
-  size_t jsonLength = json.length();
-  uint8_t* encrypted = new uint8_t[jsonLength];
-  uint8_t key = 0xAB;
-  
-  for (size_t i = 0; i < jsonLength; i++) {
-    encrypted[i] = json.charAt(i) ^ key;
-    key = encrypted[i];
+}
+
+// (Re)open the warm socket so a press never waits on a handshake
+void keepWarm() {
+  if (!keepConnectionOpen() || !commandPrepared[ACTION_STOP]) return;
+  if (serverType.equalsIgnoreCase("mqtt")) return;  // mqttTick keeps its own session
+  if (WiFi.status() != WL_CONNECTED || netClient.connected()) return;
+  if (millis() - lastWarmAttempt < WARM_RETRY_MS) return;
+  lastWarmAttempt = millis();
+  
+  bool reused;
+  bool kasa = serverType.equalsIgnoreCase("kasa");
+  if (connectTarget(kasa ? baseURL.c_str() : targetHost, kasa ? KASA_PORT : targetPort, reused)) {
+    Serial.println("Warm connection to target open");
   }
-  
-  uint8_t header[4] = {
-    (uint8_t)((jsonLength >> 24) & 0xFF),
-    (uint8_t)((jsonLength >> 16) & 0xFF),
-    (uint8_t)((jsonLength >> 8) & 0xFF),
-    (uint8_t)(jsonLength & 0xFF)
-  };
-  
-  client.write(header, 4);
-  client.write(encrypted, jsonLength);
-  client.flush();
-  delete[] encrypted;
-  
-  // Wait for response
-  unsigned long timeout = millis() + 3000;
-  bool dataReceived = false;
-  
-  while (millis() < timeout) {
-    if (client.available()) {
-      dataReceived = true;
+}
+
+// Read up to len bytes, stopping early on timeout or when the peer closes
+size_t readFully(WiFiClient& client, uint8_t* buffer, size_t len, unsigned long timeoutMs) {
+  size_t received = 0;
+  unsigned long start = millis();
+
+  while (received < len && millis() - start < timeoutMs) {
+    int available = client.available();
+    if (available > 0) {
+      size_t chunk = len - received;
+      if ((size_t)available < chunk) chunk = available;
+      received += client.read(buffer + received, chunk);
+    } else if (!client.connected()) {
       break;
+    } else {
+      delay(1);
     }
-    delay(10);
   }
-  
-  if (!dataReceived) {
-    Serial.println("Command timeout");
-    client.stop();
-    return false;
+
+  return received;
+}
+
+// Copy the string value of "key" in a flat JSON reply into out
+bool extractJsonString(const char* src, const char* key, char* out, size_t outSize) {
+  char pattern[24];
+  snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+
+  const char* start = strstr(src, pattern);
+  if (start == nullptr) return false;
+  start += strlen(pattern);
+
+  const char* end = strchr(start, '"');
+  if (end == nullptr || (size_t)(end - start) >= outSize) return false;
+
+  memcpy(out, start, end - start);
+  out[end - start] = 0;
+  return true;
+}
+
+// Build a TP-Link frame (big-endian length header + XOR-encrypted JSON)
+size_t kasaEncrypt(const char* json, uint8_t* frame, size_t frameSize) {
+  size_t jsonLength = strlen(json);
+  if (jsonLength + 4 > frameSize) {
+    Serial.println("Kasa request too large for frame buffer");
+    return 0;
   }
-  
-  // Process response
-  if (client.available()) {
-    // Skip length header
-    for (int i = 0; i < 4 && client.available(); i++) {
-      client.read();
+
+  frame[0] = (uint8_t)((jsonLength >> 24) & 0xFF);
+  frame[1] = (uint8_t)((jsonLength >> 16) & 0xFF);
+  frame[2] = (uint8_t)((jsonLength >> 8) & 0xFF);
+  frame[3] = (uint8_t)(jsonLength & 0xFF);
+
+  uint8_t key = 0xAB;
+  for (size_t i = 0; i < jsonLength; i++) {
+    frame[4 + i] = json[i] ^ key;
+    key = frame[4 + i];
+  }
+
+  return jsonLength + 4;
+}
+
+// Send a Kasa frame and decrypt the reply into responseArena.
+// Returns the reply length, or -1 on failure.
+int kasaExchange(const char* ip, const uint8_t* frame, size_t frameLength) {
+  uint8_t header[4];
+  bool reused = false;
+  
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!connectTarget(ip, KASA_PORT, reused)) {
+      Serial.println("Failed to connect to Kasa device");
+      kasaDiscoveryRequested = true;
+      return -1;
     }
     
-    // Decrypt response
-    String response = "";
-    uint8_t decryptKey = 0xAB;
+    netClient.write(frame, frameLength);
+    if (readFully(netClient, header, 4, NET_TIMEOUT_MS) == 4) break;
     
-    while (client.available()) {
-      uint8_t c = client.read();
-      uint8_t decrypted = c ^ decryptKey;
-      decryptKey = c;
-      response += (char)decrypted;
+    netClient.stop();
+    // The device may have dropped a warm socket; retry once on a fresh one
+    if (!reused) {
+      Serial.println("Kasa reply timeout");
+      kasaDiscoveryRequested = true;
+      return -1;
     }
-    
-    responseProcessor(response);
-    
-    client.stop();
-    return true;
   }
   
-  client.stop();
-  return false;
+  // Keep what fits; ids and err_code are near the start of the reply
+  size_t replyLength = ((size_t)header[0] << 24) | ((size_t)header[1] << 16) |
+                       ((size_t)header[2] << 8) | header[3];
+  size_t keepLength = replyLength;
+  if (keepLength > RESPONSE_ARENA_SIZE - 1) keepLength = RESPONSE_ARENA_SIZE - 1;
+  
+  size_t received = readFully(netClient, (uint8_t*)responseArena, keepLength, NET_TIMEOUT_MS);
+  releaseTarget(received == replyLength);
+
+  kasaDecrypt(responseArena, received);
+  return received;
 }
 
-// Function to send raw Kasa json command
-bool sendRawKasaCommand(const String& ip, const String& json, bool infoOnly) {
-  WiFiClient client;
-  const int kasaPort = 9999;
-  bool success = false;
-  
-  Serial.print("Sending raw command to Kasa device: ");
-  Serial.println(json);
+// Decrypt a TP-Link XOR payload in place and NUL-terminate it
+void kasaDecrypt(char* buffer, size_t len) {
+  uint8_t key = 0xAB;
+  for (size_t i = 0; i < len; i++) {
+    uint8_t c = buffer[i];
+    buffer[i] = c ^ key;
+    key = c;
+  }
+  buffer[len] = 0;
+}
+
+// Get information from the Kasa device including device ID and child IDs
+bool getKasaDeviceInfo(const char* ip) {
+  kasaDeviceId[0] = 0;
+  kasaModel[0] = 0;
+  kasaNumChildren = 0;
   
-  if (!client.connect(ip.c_str(), kasaPort)) {
-    Serial.println("Failed to connect to Kasa device");
+  Serial.println("Getting device info...");
+  size_t frameLength = kasaEncrypt("{\"system\":{\"get_sysinfo\":{}}}", kasaFrame, sizeof(kasaFrame));
+  if (kasaExchange(ip, kasaFrame, frameLength) <= 0) {
+    Serial.println("Info query failed");
     return false;
   }
   
-  // Encrypt the payload (TP-Link XOR encryption)
-  size_t jsonLength = json.length();
-  uint8_t* encrypted = new uint8_t[jsonLength];
-  uint8_t key = 0xAB;
+  Serial.println("Device info response received");
   
-  for (size_t i = 0; i < jsonLength; i++) {
-    encrypted[i] = json.charAt(i) ^ key;
-    key = encrypted[i];
-  }
-  
-  // Prepare the 4-byte header (big-endian length)
-  uint8_t header[4] = {
-    (uint8_t)((jsonLength >> 24) & 0xFF),
-    (uint8_t)((jsonLength >> 16) & 0xFF),
-    (uint8_t)((jsonLength >> 8) & 0xFF),
-    (uint8_t)(jsonLength & 0xFF)
-  };
-  
-  client.write(header, 4);
-  client.write(encrypted, jsonLength);
-  client.flush();
-  delete[] encrypted;
-  
-  // Wait for and read response
-  unsigned long timeout = millis() + 3000;
-  bool dataReceived = false;
-  
-  while (millis() < timeout) {
-    if (client.available()) {
-      dataReceived = true;
-      break;
+  if (extractJsonString(responseArena, "deviceId", kasaDeviceId, sizeof(kasaDeviceId))) {
+    Serial.print("Device ID: ");
+    Serial.println(kasaDeviceId);
+    
+    if (kasaKnownId[0] == 0) {
+      // First contact: remember which device lives at this address
+      strcpy(kasaKnownId, kasaDeviceId);
+      saveKasaLocation(nullptr);
+    } else if (strcmp(kasaKnownId, kasaDeviceId) != 0) {
+      // DHCP handed our address to another plug; never switch the wrong one
+      Serial.println("Device at configured IP is not the known Kasa device");
+      kasaDiscoveryRequested = true;
+      return false;
     }
-    delay(10);
   }
-  
-  if (!dataReceived) {
-    Serial.println("Raw command timeout");
-    client.stop();
-    return false;
+
+  if (extractJsonString(responseArena, "model", kasaModel, sizeof(kasaModel))) {
+    Serial.print("Device model: ");
+    Serial.println(kasaModel);
   }
   
-  // Read and process response
-  if (client.available()) {
-    // Skip the header (first 4 bytes)
-    for (int i = 0; i < 4 && client.available(); i++) {
-      client.read();
-    }
-    
-    // Decrypt response
-    String response = "";
-    uint8_t decryptKey = 0xAB;
-    while (client.available()) {
-      uint8_t c = client.read();
-      uint8_t decrypted = c ^ decryptKey;
-      decryptKey = c;
-      response += (char)decrypted;
+  // Walk the children array, collecting each child's id
+  const char* children = strstr(responseArena, "\"children\":[");
+  if (children != nullptr) {
+    const char* arrayEnd = strchr(children, ']');
+    const char* cursor = children;
+
+    while (kasaNumChildren < KASA_MAX_CHILDREN) {
+      cursor = strstr(cursor, "\"id\":\"");
+      if (cursor == nullptr || (arrayEnd != nullptr && cursor > arrayEnd)) break;
+
+      if (!extractJsonString(cursor, "id", kasaChildIds[kasaNumChildren], KASA_ID_LEN)) break;
+      Serial.print("Child ");
+      Serial.print(kasaNumChildren);
+      Serial.print(" ID: ");
+      Serial.println(kasaChildIds[kasaNumChildren]);
+      kasaNumChildren++;
+      cursor += 6;
     }
     
-    Serial.print("Raw command response: ");
-    Serial.println(response);
-    
-    if (response.indexOf("\"err_code\":0") > 0) {
-      success = true;
-      Serial.println("Raw command successful");
-    } else {
-      Serial.println("Raw command failed or returned error");
-    }
+    Serial.print("Found ");
+    Serial.print(kasaNumChildren);
+    Serial.println(" children");
   }
-  
-  client.stop();
-  return success;
+
+  return kasaNumChildren > 0;
 }
 
-// Send command to OctoPrint server
-bool sendOctoPrintCommand(const String& gcode) {
-  WiFiClient client;
-  HTTPClient http;
-  bool success = false;
-  
-  Serial.print("Sending to OctoPrint: ");
-  Serial.println(gcode);
-  
-  String url = baseURL + "/api/printer/command";
-  String payload = "{\"command\": \"" + gcode + "\"}";
-  
-  http.begin(client, url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader("X-Api-Key", apiKey);
+// Persist the known device id, and the device's new address if it moved
+void saveKasaLocation(const char* ip) {
+  EEPROM.begin(EEPROM_SIZE);
   
-  int httpCode = http.POST(payload);
+  for (int i = 0; i < KASA_ID_LEN; i++) 
+    EEPROM.write(ADDR_KASA_ID + i, kasaKnownId[i]);
   
-  if (httpCode > 0) {
-    Serial.printf("OctoPrint HTTP response: %d\n", httpCode);
-    if (httpCode == HTTP_CODE_NO_CONTENT || httpCode == HTTP_CODE_OK) {
-      success = true;
-    }
-  } else {
-    Serial.printf("OctoPrint HTTP error: %s\n", http.errorToString(httpCode).c_str());
+  if (ip != nullptr) {
+    for (int i = 0; i < 200; i++) EEPROM.write(ADDR_URL + i, 0);
+    for (unsigned int i = 0; ip[i] != 0; i++) 
+      EEPROM.write(ADDR_URL + i, ip[i]);
+    baseURL = ip;
+    param_url.setValue(ip, 200);
   }
   
-  http.end();
-  return success;
+  EEPROM.commit();
 }
 
-// Send command to Moonraker/Klipper server
-bool sendMoonrakerCommand(const String& gcode) {
-  WiFiClient client;
-  HTTPClient http;
-  bool success = false;
-  
-  Serial.print("Sending to Moonraker: ");
-  Serial.println(gcode);
+// Broadcast get_sysinfo on UDP 9999. Every Kasa device (and each strip as
+// a whole) answers once, so a single round finds them all.
+void startKasaDiscovery() {
+  kasaDiscoveryRequested = false;
+  lastKasaDiscovery = millis();
+  
+  if (!kasaUdp.begin(0)) {  // Ephemeral local port
+    Serial.println("Kasa discovery: UDP socket unavailable");
+    return;
+  }
   
-  String url = baseURL + "/printer/gcode/script";
-  String payload = "{\"script\": \"" + gcode + "\"}";
+  // UDP discovery uses the same XOR cipher but no length header
+  size_t frameLength = kasaEncrypt("{\"system\":{\"get_sysinfo\":{}}}", kasaFrame, sizeof(kasaFrame));
+  kasaUdp.beginPacket(IPAddress(255, 255, 255, 255), KASA_PORT);
+  kasaUdp.write(kasaFrame + 4, frameLength - 4);
+  kasaUdp.endPacket();
   
-  http.begin(client, url);
-  http.addHeader("Content-Type", "application/json");
+  kasaDeviceCount = 0;
+  kasaDiscoveryStart = millis();
+  kasaDiscoveryActive = true;
+}
+
+// Collect discovery replies without blocking the loop
+void pollKasaDiscovery() {
+  int packetSize;
+  while ((packetSize = kasaUdp.parsePacket()) > 0) {
+    int len = kasaUdp.read((uint8_t*)responseArena, RESPONSE_ARENA_SIZE - 1);
+    if (len <= 0 || kasaDeviceCount >= KASA_DISCOVERY_MAX) continue;
+    kasaDecrypt(responseArena, len);
+    
+    KasaDevice& device = kasaDevices[kasaDeviceCount];
+    if (!extractJsonString(responseArena, "deviceId", device.deviceId, sizeof(device.deviceId))) continue;
+    if (!extractJsonString(responseArena, "mac", device.mac, sizeof(device.mac))) device.mac[0] = 0;
+    if (!extractJsonString(responseArena, "model", device.model, sizeof(device.model))) device.model[0] = 0;
+    
+    IPAddress ip = kasaUdp.remoteIP();
+    snprintf(device.ip, sizeof(device.ip), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+    kasaDeviceCount++;
+  }
   
-  // Moonraker uses Bearer token authentication
-  if (!apiKey.isEmpty()) {
-    http.addHeader("Authorization", "Bearer " + apiKey);
+  if (millis() - kasaDiscoveryStart >= KASA_DISCOVERY_WINDOW_MS) {
+    finishKasaDiscovery();
+  }
+}
+
+// Close the round and follow the known device if its address changed
+void finishKasaDiscovery() {
+  kasaUdp.stop();
+  kasaDiscoveryActive = false;
+  
+  Serial.print("Kasa discovery found ");
+  Serial.print(kasaDeviceCount);
+  Serial.println(" devices");
+  for (int i = 0; i < kasaDeviceCount; i++) {
+    Serial.print("  ");
+    Serial.print(kasaDevices[i].ip);
+    Serial.print(" ");
+    Serial.print(kasaDevices[i].model);
+    Serial.print(" ");
+    Serial.print(kasaDevices[i].mac);
+    Serial.print(" ");
+    Serial.println(kasaDevices[i].deviceId);
   }
   
-  int httpCode = http.POST(payload);
+  if (kasaKnownId[0] == 0) return;
   
-  if (httpCode > 0) {
-    Serial.printf("Moonraker HTTP response: %d\n", httpCode);
-    if (httpCode == HTTP_CODE_OK) {
-      String response = http.getString();
-      Serial.println("Response: " + response);
-      success = true;
+  for (int i = 0; i < kasaDeviceCount; i++) {
+    if (strcmp(kasaDevices[i].deviceId, kasaKnownId) != 0) continue;
+    
+    if (strcmp(kasaDevices[i].ip, baseURL.c_str()) != 0) {
+      Serial.print("Kasa device moved from ");
+      Serial.print(baseURL);
+      Serial.print(" to ");
+      Serial.println(kasaDevices[i].ip);
+      netClient.stop();
+      saveKasaLocation(kasaDevices[i].ip);
     }
-  } else {
-    Serial.printf("Moonraker HTTP error: %s\n", http.errorToString(httpCode).c_str());
+    
+    if (!commandPrepared[ACTION_STOP]) {
+      prepareCommand();
+    }
+    return;
   }
   
-  http.end();
-  return success;
+  Serial.println("Known Kasa device not found by discovery");
 }
 
-// Send a command based on the configured server type
-void sendCommand() {
-  digitalWrite(LED_PIN, LED_ON);
-  bool success = false;
-  
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("WiFi not connected - cannot send command");
-    digitalWrite(LED_PIN, LED_OFF);
-    return;
+// Kasa mode: rediscover periodically, or right away after a failed exchange
+void kasaDiscoveryTick() {
+  if (!serverType.equalsIgnoreCase("kasa") || WiFi.status() != WL_CONNECTED) return;
+  
+  if (kasaDiscoveryActive) {
+    pollKasaDiscovery();
+  } else if (kasaDiscoveryRequested || millis() - lastKasaDiscovery >= KASA_DISCOVERY_INTERVAL_MS) {
+    startKasaDiscovery();
   }
-  
+}
+
+// Build the set_relay_state JSON for one outlet addressing method into kasaJson.
+// Returns the JSON length, or 0 if the method does not apply.
+int buildKasaRelayJson(int method) {
+  int state = kasaTurnOn ? 1 : 0;
+  int len = 0;
+
+  switch (method) {
+    case KASA_BY_CHILD_ID:
+      len = snprintf(kasaJson, sizeof(kasaJson),
+                     "{\"context\":{\"child_ids\":[\"%s\"]},\"system\":{\"set_relay_state\":{\"state\":%d}}}",
+                     kasaChildIds[kasaOutlet], state);
+      break;
+    case KASA_BY_DERIVED_ID: {
+      // KP200 second outlet: first child's id with the trailing "00" swapped for "01"
+      size_t idLength = strlen(kasaChildIds[0]);
+      if (idLength < 2) return 0;
+      len = snprintf(kasaJson, sizeof(kasaJson),
+                     "{\"context\":{\"child_ids\":[\"%.*s01\"]},\"system\":{\"set_relay_state\":{\"state\":%d}}}",
+                     (int)(idLength - 2), kasaChildIds[0], state);
+      break;
+    }
+    case KASA_BY_CHILD_INDEX:
+      len = snprintf(kasaJson, sizeof(kasaJson),
+                     "{\"context\":{\"child_ids\":[1]},\"system\":{\"set_relay_state\":{\"state\":%d}}}",
+                     state);
+      break;
+    case KASA_BY_OUTLET_PARAM:
+      len = snprintf(kasaJson, sizeof(kasaJson),
+                     "{\"system\":{\"set_relay_state\":{\"state\":%d,\"outlet\":1}}}",
+                     state);
+      break;
+    default:
+      return 0;
+  }
+    
+  if (len <= 0 || len >= (int)sizeof(kasaJson)) return 0;
+  return len;
+}
+    
+// Resolve the Kasa outlet and pre-build its encrypted relay frame
+bool prepareKasaCommand() {
+  parseKasaCommand(gcode.c_str(), kasaOutlet, kasaTurnOn);
+
+  if (!getKasaDeviceInfo(baseURL.c_str())) {
+    Serial.println("Failed to get device info");
+    return false;
+  }
+
+  // If we have outlet 1 requested but only one child found, it might be a KP200
+  // even if we can't confirm from the model name
+  kasaSpecialOutlet = (kasaOutlet == 1 && kasaNumChildren <= 1);
+
+  if (kasaSpecialOutlet) {
+    if (strstr(kasaModel, "KP200") != nullptr) {
+      Serial.println("Detected KP200 model - enabling special dual-outlet handling");
+    } else {
+      Serial.println("Outlet 1 requested but only 1 child found - trying special handling");
+    }
+    kasaPreparedMethod = KASA_BY_DERIVED_ID;
+  } else if (kasaOutlet >= kasaNumChildren) {
+    Serial.print("Error: Outlet ");
+    Serial.print(kasaOutlet);
+    Serial.print(" requested but device only has ");
+    Serial.print(kasaNumChildren);
+    Serial.println(" outlets");
+    return false;
+  } else {
+    kasaPreparedMethod = KASA_BY_CHILD_ID;
+  }
+    
+  // Fall through to the next method if the preferred one doesn't apply
+  while (buildKasaRelayJson(kasaPreparedMethod) == 0) {
+    if (++kasaPreparedMethod > KASA_BY_OUTLET_PARAM) return false;
+  }
+      
+  Serial.print("Prepared Kasa command: ");
+  Serial.println(kasaJson);
+          
+  requestLength[ACTION_STOP] = kasaEncrypt(kasaJson, requestArena[ACTION_STOP], REQUEST_ARENA_SIZE);
+  return requestLength[ACTION_STOP] > 0;
+}
+        
+// Send an encrypted relay frame and check the device accepted it
+bool sendKasaFrame(const uint8_t* frame, size_t frameLength) {
+  if (kasaExchange(baseURL.c_str(), frame, frameLength) < 0) {
+    return false;
+  }
+        
+  Serial.print("Kasa response: ");
+  Serial.println(responseArena);
+      
+  if (strstr(responseArena, "\"err_code\":0") != nullptr) {
+    Serial.println("Kasa command successful");
+    return true;
+  }
+
+  Serial.println("Kasa command failed or returned error");
+  return false;
+}
+
+// Send command to the specific outlet of a TP-Link Kasa device
+bool sendKasaCommand() {
+  if (sendKasaFrame(requestArena[ACTION_STOP], requestLength[ACTION_STOP])) {
+    return true;
+  }
+
+  if (!kasaSpecialOutlet) {
+    return false;
+  }
+
+  // KP200 second outlet: try the remaining addressing methods in order
+  for (int method = kasaPreparedMethod + 1; method <= KASA_BY_OUTLET_PARAM; method++) {
+    if (buildKasaRelayJson(method) == 0) continue;
+
+    Serial.print("Trying second outlet with: ");
+    Serial.println(kasaJson);
+
+    size_t frameLength = kasaEncrypt(kasaJson, kasaFrame, sizeof(kasaFrame));
+    if (frameLength > 0 && sendKasaFrame(kasaFrame, frameLength)) {
+      return true;
+    }
+  }
+  
+  Serial.println("All methods failed for second outlet");
+  return false;
+}
+
+// Split baseURL into host, port and path prefix for the raw HTTP client
+bool parseBaseURL(const char* url, uint16_t defaultPort) {
+  if (strncasecmp(url, "https://", 8) == 0) {
+    Serial.println("HTTPS is not supported - use an http:// base URL");
+    return false;
+  }
+  if (strncasecmp(url, "http://", 7) == 0) {
+    url += 7;
+  }
+  else if (strncasecmp(url, "mqtt://", 7) == 0 || strncasecmp(url, "tcp://", 6) == 0) {
+    url = strstr(url, "://") + 3;
+  }
+
+  size_t hostLength = strcspn(url, ":/");
+  if (hostLength == 0 || hostLength >= sizeof(targetHost)) {
+    Serial.println("Invalid host in base URL");
+    return false;
+  }
+  memcpy(targetHost, url, hostLength);
+  targetHost[hostLength] = 0;
+  url += hostLength;
+
+  targetPort = defaultPort;
+  if (*url == ':') {
+    targetPort = atoi(url + 1);
+    url += 1 + strspn(url + 1, "0123456789");
+  }
+
+  // Keep any path prefix (e.g. "/octoprint", or the MQTT topic), minus trailing slashes
+  size_t pathLength = strlen(url);
+  while (pathLength > 0 && url[pathLength - 1] == '/') pathLength--;
+  if (pathLength >= sizeof(targetPath)) {
+    Serial.println("Base URL path too long");
+    return false;
+  }
+  memcpy(targetPath, url, pathLength);
+  targetPath[pathLength] = 0;
+
+  return true;
+}
+
+// Pre-build the complete HTTP POST for one action's JSON endpoint
+bool prepareHttpCommand(int action, const char* path, const char* body, bool bearer) {
+  int bodyLength = strlen(body);
+
+  // OctoPrint takes X-Api-Key, Moonraker uses Bearer token authentication
+  char auth[140] = "";
+  if (!apiKey.isEmpty()) {
+    snprintf(auth, sizeof(auth), bearer ? "Authorization: Bearer %s\r\n" : "X-Api-Key: %s\r\n",
+             apiKey.c_str());
+  }
+  
+  int len = snprintf((char*)requestArena[action], REQUEST_ARENA_SIZE,
+                     "POST %s%s HTTP/1.1\r\n"
+                     "Host: %s:%u\r\n"
+                     "Content-Type: application/json\r\n"
+                     "%s"
+                     "Content-Length: %d\r\n"
+                     "Connection: %s\r\n"
+                     "\r\n"
+                     "%s",
+                     targetPath, path, targetHost, targetPort, auth, bodyLength,
+                     powerProfile == PROFILE_LATENCY ? "keep-alive" : "close", body);
+  if (len <= 0 || len >= REQUEST_ARENA_SIZE) {
+    Serial.println("HTTP request too large for request arena");
+    return false;
+  }
+  
+  requestLength[action] = len;
+  return true;
+}
+  
+// Send the prepared HTTP request and check the status code
+bool sendHttpCommand(const char* label, int action, bool acceptNoContent) {
+  int httpCode = -1;
+  bool reused = false;
+  bool reusable = false;
+
+  Serial.print("Sending ");
+  Serial.print(actionNames[action]);
+  Serial.print(" to ");
+  Serial.print(label);
+  Serial.print(": ");
+  Serial.println(action == ACTION_STOP ? gcode.c_str() : actionNames[action]);
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!connectTarget(targetHost, targetPort, reused)) {
+      Serial.print(label);
+      Serial.println(" connection failed");
+      return false;
+    }
+    
+    netClient.write(requestArena[action], requestLength[action]);
+    httpCode = readHttpResponse(reusable);
+    if (httpCode > 0) break;
+    
+    netClient.stop();
+    // The server may have closed a warm keep-alive socket; retry once
+    if (!reused) break;
+  }
+  releaseTarget(reusable);
+  
+  if (httpCode <= 0) {
+    Serial.print(label);
+    Serial.println(" HTTP error: no response");
+    return false;
+  }
+  
+  Serial.print(label);
+  Serial.print(" HTTP response: ");
+  Serial.println(httpCode);
+
+  const char* body = strstr(responseArena, "\r\n\r\n");
+  if (body != nullptr && body[4] != 0) {
+    Serial.print("Response: ");
+    Serial.println(body + 4);
+  }
+
+  // A client error (bad key, nothing printing to pause) won't change on a
+  // resend; timeouts and rate limits might
+  if (httpCode >= 400 && httpCode < 500 && httpCode != 408 && httpCode != 429) {
+    sendRejected = true;
+  }
+
+  return httpCode == 200 || (acceptNoContent && httpCode == 204);
+}
+
+// Read one HTTP response into responseArena and return its status code, or -1.
+// reusable is set when the body was fully framed and the server keeps the
+// connection open, so the next request can go out on the same socket.
+int readHttpResponse(bool& reusable) {
+  size_t received = 0;
+  long contentLength = -1;
+  const char* body = nullptr;
+  unsigned long start = millis();
+  
+  reusable = false;
+  responseArena[0] = 0;
+  
+  while (received < RESPONSE_ARENA_SIZE - 1 && millis() - start < NET_TIMEOUT_MS) {
+    int available = netClient.available();
+    if (available <= 0) {
+      if (!netClient.connected()) break;
+      delay(1);
+      continue;
+    }
+    
+    size_t chunk = RESPONSE_ARENA_SIZE - 1 - received;
+    if ((size_t)available < chunk) chunk = available;
+    received += netClient.read((uint8_t*)responseArena + received, chunk);
+    responseArena[received] = 0;
+    
+    if (body == nullptr) {
+      const char* headerEnd = strstr(responseArena, "\r\n\r\n");
+      if (headerEnd == nullptr) continue;
+      body = headerEnd + 4;
+      
+      // Find Content-Length (header names are case-insensitive)
+      for (const char* line = strstr(responseArena, "\r\n"); line != nullptr && line < headerEnd;
+           line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+          contentLength = atol(line + 17);
+        }
+      }
+      
+      int status = atoi(responseArena + 9);
+      if (status == 204 || status == 304) contentLength = 0;
+    }
+    
+    if (contentLength >= 0 && received - (body - responseArena) >= (size_t)contentLength) {
+      reusable = true;
+      break;
+    }
+  }
+  
+  if (strncmp(responseArena, "HTTP/1.", 7) != 0) {
+    return -1;
+  }
+  return atoi(responseArena + 9);
+}
+
+// Send command to OctoPrint server
+bool sendOctoPrintCommand(int action) {
+  return sendHttpCommand("OctoPrint", action, true);
+}
+
+// Send command to Moonraker/Klipper server
+bool sendMoonrakerCommand(int action) {
+  return sendHttpCommand("Moonraker", action, false);
+}
+  
+// Pre-build one newline-terminated G-code line per action for the raw TCP bridge.
+// Pause and cancel use Marlin's M25 (pause SD print) and M524 (abort SD print).
+bool prepareRawCommand() {
+  for (int action = 0; action < ACTION_COUNT; action++) {
+    const char* line = action == ACTION_STOP ? gcode.c_str() : (action == ACTION_PAUSE ? "M25" : "M524");
+    int len = snprintf((char*)requestArena[action], REQUEST_ARENA_SIZE, "%s\n", line);
+    if (len <= 0 || len >= REQUEST_ARENA_SIZE) return false;
+    requestLength[action] = len;
+  }
+  return true;
+}
+
+// Read reply lines until an acknowledgement or timeout. "ok" acknowledges a
+// command; after M112 Marlin prints a "Printer halted" error instead.
+bool waitForRawAck() {
+#if RAW_WAIT_FOR_OK
+  size_t len = 0;
+  unsigned long start = millis();
+  
+  while (millis() - start < NET_TIMEOUT_MS) {
+    if (netClient.available() <= 0) {
+      if (!netClient.connected()) return false;
+      delay(1);
+      continue;
+    }
+    
+    char c = netClient.read();
+    if (c == '\r') continue;
+    if (c != '\n') {
+      if (len < RESPONSE_ARENA_SIZE - 1) responseArena[len++] = c;
+      continue;
+    }
+    
+    responseArena[len] = 0;
+    len = 0;
+    if (responseArena[0] == 0) continue;
+    
+    Serial.print("Raw reply: ");
+    Serial.println(responseArena);
+    if (strncmp(responseArena, "ok", 2) == 0 || strstr(responseArena, "halted") != nullptr) {
+      return true;
+    }
+  }
+  return false;
+#else
+  return netClient.connected();
+#endif
+}
+
+// Write the prepared G-code line on the open bridge socket
+bool sendRawCommand(int action) {
+  bool reused = false;
+  
+  Serial.print("Sending ");
+  Serial.print(actionNames[action]);
+  Serial.print(" over raw TCP: ");
+  Serial.write(requestArena[action], requestLength[action]);
+  
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!connectTarget(targetHost, targetPort, reused)) {
+      Serial.println("Raw TCP connection failed");
+      return false;
+    }
+    
+    // Drop anything the printer sent since the last command (temperature
+    // reports, stale "ok"s) so only this command's reply is matched
+    while (netClient.available() > 0) {
+      netClient.read((uint8_t*)responseArena, RESPONSE_ARENA_SIZE);
+    }
+    
+    netClient.write(requestArena[action], requestLength[action]);
+    if (waitForRawAck()) {
+      releaseTarget(true);
+      return true;
+    }
+    
+    netClient.stop();
+    // The bridge may have dropped the warm socket; retry once on a fresh one
+    if (!reused) break;
+  }
+  
+  Serial.println("Raw TCP command not acknowledged");
+  return false;
+}
+
+// Append an MQTT string (2-byte big-endian length, then the bytes)
+size_t mqttPutString(uint8_t* out, const char* str, size_t len) {
+  out[0] = (uint8_t)(len >> 8);
+  out[1] = (uint8_t)(len & 0xFF);
+  memcpy(out + 2, str, len);
+  return len + 2;
+}
+
+// Packets are built with their body at packet + 5 (room for the largest
+// fixed header); this writes the fixed header and slides the body up to it.
+// Returns the total packet length.
+size_t mqttFinish(uint8_t* packet, uint8_t type, size_t bodyLength) {
+  uint8_t header[5];
+  size_t headerLength = 0;
+  size_t remaining = bodyLength;
+  
+  header[headerLength++] = type;
+  do {
+    uint8_t digit = remaining % 128;
+    remaining /= 128;
+    if (remaining > 0) digit |= 0x80;
+    header[headerLength++] = digit;
+  } while (remaining > 0);
+  
+  memmove(packet + headerLength, packet + 5, bodyLength);
+  memcpy(packet, header, headerLength);
+  return headerLength + bodyLength;
+}
+
+// Read one MQTT packet, keeping its body in responseArena.
+// Returns the packet type (high nibble of the first byte), or -1.
+int mqttReadPacket() {
+  uint8_t header;
+  if (readFully(netClient, &header, 1, NET_TIMEOUT_MS) != 1) return -1;
+  
+  size_t length = 0;
+  uint8_t digit;
+  for (int shift = 0; ; shift += 7) {
+    if (shift > 21 || readFully(netClient, &digit, 1, NET_TIMEOUT_MS) != 1) return -1;
+    length |= (size_t)(digit & 0x7F) << shift;
+    if (!(digit & 0x80)) break;
+  }
+  
+  // Nothing we expect is large; drop whatever doesn't fit
+  size_t keep = length < RESPONSE_ARENA_SIZE ? length : RESPONSE_ARENA_SIZE;
+  if (readFully(netClient, (uint8_t*)responseArena, keep, NET_TIMEOUT_MS) != keep) return -1;
+  for (size_t i = keep; i < length; i++) {
+    if (readFully(netClient, &digit, 1, NET_TIMEOUT_MS) != 1) return -1;
+  }
+  
+  return header & 0xF0;
+}
+
+// Pre-build the CONNECT packet and one QoS 1 PUBLISH per action.
+// baseURL is mqtt://broker[:port]/topic; the API key field may hold user:password.
+bool prepareMqttCommand() {
+  const char* topic = targetPath[0] == '/' ? targetPath + 1 : targetPath;
+  size_t topicLength = strlen(topic);
+  if (topicLength == 0) {
+    Serial.println("MQTT topic missing - use mqtt://broker[:port]/topic");
+    return false;
+  }
+  snprintf(mqttStatusTopic, sizeof(mqttStatusTopic), "%s/status", topic);
+  
+  char clientId[24];
+  snprintf(clientId, sizeof(clientId), "estop-%06x", ESP.getChipId());
+  
+  const char* user = apiKey.c_str();
+  const char* colon = strchr(user, ':');
+  size_t userLength = colon ? (size_t)(colon - user) : strlen(user);
+  const char* password = colon ? colon + 1 : nullptr;
+  
+  // MQTT 3.1.1 allows a password only together with a user name
+  if (userLength == 0 && password != nullptr) {
+    Serial.println("MQTT password without a user name ignored - use user:password");
+    password = nullptr;
+  }
+  
+  // CONNECT: clean session, will on <topic>/status = "offline" (QoS 1, retained).
+  // All fields are bounded by their config sizes, so this fits MQTT_CONNECT_SIZE.
+  uint8_t* body = mqttConnectPacket + 5;
+  size_t n = mqttPutString(body, "MQTT", 4);
+  uint8_t flags = 0x02 | 0x04 | 0x08 | 0x20;
+  if (userLength > 0) flags |= 0x80;
+  if (password != nullptr) flags |= 0x40;
+  body[n++] = 4;  // Protocol level 3.1.1
+  body[n++] = flags;
+  body[n++] = MQTT_KEEPALIVE_S >> 8;
+  body[n++] = MQTT_KEEPALIVE_S & 0xFF;
+  n += mqttPutString(body + n, clientId, strlen(clientId));
+  n += mqttPutString(body + n, mqttStatusTopic, strlen(mqttStatusTopic));
+  n += mqttPutString(body + n, "offline", 7);
+  if (userLength > 0) n += mqttPutString(body + n, user, userLength);
+  if (password != nullptr) n += mqttPutString(body + n, password, strlen(password));
+  mqttConnectLength = mqttFinish(mqttConnectPacket, 0x10, n);
+  
+  // PUBLISH (QoS 1) of the G-code for stop, or the action name for pause/cancel
+  for (int action = 0; action < ACTION_COUNT; action++) {
+    const char* payload = action == ACTION_STOP ? gcode.c_str() : actionNames[action];
+    size_t payloadLength = strlen(payload);
+    if (5 + 2 + topicLength + 2 + payloadLength > REQUEST_ARENA_SIZE) return false;
+    
+    body = requestArena[action] + 5;
+    n = mqttPutString(body, topic, topicLength);
+    body[n++] = 0;  // Packet id, patched on send
+    body[n++] = 0;
+    memcpy(body + n, payload, payloadLength);
+    n += payloadLength;
+    requestLength[action] = mqttFinish(requestArena[action], 0x32, n);
+    mqttIdOffset[action] = requestLength[action] - payloadLength - 2;
+  }
+  
+  mqttSession = false;
+  return true;
+}
+
+// Open the broker session if it isn't already: CONNECT, CONNACK, then a
+// retained "online" on the status topic
+bool mqttConnect() {
+  if (mqttSession && netClient.connected()) return true;
+  
+  mqttSession = false;
+  netClient.stop();
+  if (!netClient.connect(targetHost, targetPort)) {
+    Serial.println("MQTT broker connection failed");
+    return false;
+  }
+  netClient.setNoDelay(true);
+  netClient.write(mqttConnectPacket, mqttConnectLength);
+  
+  if (mqttReadPacket() != 0x20 || responseArena[1] != 0) {
+    Serial.println("MQTT broker did not accept the connection");
+    netClient.stop();
+    return false;
+  }
+  
+  uint8_t status[5 + 2 + sizeof(mqttStatusTopic) + 6];
+  size_t n = mqttPutString(status + 5, mqttStatusTopic, strlen(mqttStatusTopic));
+  memcpy(status + 5 + n, "online", 6);
+  netClient.write(status, mqttFinish(status, 0x31, n + 6));
+  
+  mqttSession = true;
+  mqttLastSend = millis();
+  Serial.println("MQTT session open");
+  return true;
+}
+
+// Publish the prepared message on the open session and wait for its PUBACK
+bool sendMqttCommand(int action) {
+  uint8_t* packet = requestArena[action];
+  if (++mqttPacketId == 0) mqttPacketId = 1;
+  packet[mqttIdOffset[action]] = mqttPacketId >> 8;
+  packet[mqttIdOffset[action] + 1] = mqttPacketId & 0xFF;
+  packet[0] &= ~0x08;
+  
+  Serial.print("Publishing ");
+  Serial.print(actionNames[action]);
+  Serial.print(" to MQTT topic: ");
+  Serial.println(targetPath);
+  
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (!mqttConnect()) return false;
+    
+    netClient.write(packet, requestLength[action]);
+    mqttLastSend = millis();
+    
+    unsigned long start = millis();
+    while (millis() - start < NET_TIMEOUT_MS) {
+      int type = mqttReadPacket();
+      if (type < 0) break;
+      if (type == 0x40 && (((uint8_t)responseArena[0] << 8) | (uint8_t)responseArena[1]) == mqttPacketId) {
+        Serial.println("MQTT PUBACK received");
+        return true;
+      }
+    }
+    
+    // No PUBACK: drop the session and redeliver once, flagged as a duplicate
+    mqttSession = false;
+    netClient.stop();
+    packet[0] |= 0x08;
+  }
+  
+  Serial.println("MQTT publish not acknowledged");
+  return false;
+}
+
+// Keep the broker session open: reconnect after drops and ping within the keepalive
+void mqttTick() {
+  if (!serverType.equalsIgnoreCase("mqtt") || !commandPrepared[ACTION_STOP]) return;
+  if (WiFi.status() != WL_CONNECTED) return;
+  
+  if (!mqttSession || !netClient.connected()) {
+    if (millis() - lastWarmAttempt < WARM_RETRY_MS) return;
+    lastWarmAttempt = millis();
+    mqttConnect();
+    return;
+  }
+  
+  // Drain anything the broker sent (PINGRESP)
+  while (netClient.available() > 0) {
+    if (mqttReadPacket() < 0) {
+      mqttSession = false;
+      netClient.stop();
+      return;
+    }
+  }
+  
+  if (millis() - mqttLastSend >= MQTT_KEEPALIVE_S * 500UL) {
+    uint8_t ping[2] = { 0xC0, 0x00 };
+    netClient.write(ping, 2);
+    mqttLastSend = millis();
+  }
+}
+
+// Build the wire payload for the configured target so a press only has to send it
+bool prepareCommand() {
+  for (int action = 0; action < ACTION_COUNT; action++) {
+    commandPrepared[action] = false;
+    requestLength[action] = 0;
+  }
+  
+  if (baseURL.isEmpty() || gcode.isEmpty()) {
+    return false;
+  }
+  
+  if (serverType.equalsIgnoreCase("kasa")) {
+    // A relay can only be switched; pause/cancel have no Kasa equivalent
+    commandPrepared[ACTION_STOP] = prepareKasaCommand();
+  }
+  else if (serverType.equalsIgnoreCase("raw")) {
+    commandPrepared[ACTION_STOP] = parseBaseURL(baseURL.c_str(), RAW_PORT) && prepareRawCommand();
+    commandPrepared[ACTION_PAUSE] = commandPrepared[ACTION_CANCEL] = commandPrepared[ACTION_STOP];
+  }
+  else if (serverType.equalsIgnoreCase("mqtt")) {
+    commandPrepared[ACTION_STOP] = parseBaseURL(baseURL.c_str(), MQTT_PORT) && prepareMqttCommand();
+    commandPrepared[ACTION_PAUSE] = commandPrepared[ACTION_CANCEL] = commandPrepared[ACTION_STOP];
+  }
+  else if (parseBaseURL(baseURL.c_str(), 80)) {
+    char body[160];
+    
+    if (serverType.equalsIgnoreCase("moon")|| serverType.equalsIgnoreCase("moonraker")) {
+      snprintf(body, sizeof(body), "{\"script\": \"%s\"}", gcode.c_str());
+      commandPrepared[ACTION_STOP] = prepareHttpCommand(ACTION_STOP, "/printer/gcode/script", body, true);
+      commandPrepared[ACTION_PAUSE] = prepareHttpCommand(ACTION_PAUSE, "/printer/print/pause", "", true);
+      commandPrepared[ACTION_CANCEL] = prepareHttpCommand(ACTION_CANCEL, "/printer/print/cancel", "", true);
+    }
+    else {
+      // Default to OctoPrint
+      snprintf(body, sizeof(body), "{\"command\": \"%s\"}", gcode.c_str());
+      commandPrepared[ACTION_STOP] = prepareHttpCommand(ACTION_STOP, "/api/printer/command", body, false);
+      commandPrepared[ACTION_PAUSE] = prepareHttpCommand(ACTION_PAUSE, "/api/job",
+                                                         "{\"command\": \"pause\", \"action\": \"pause\"}", false);
+      commandPrepared[ACTION_CANCEL] = prepareHttpCommand(ACTION_CANCEL, "/api/job",
+                                                          "{\"command\": \"cancel\"}", false);
+    }
+  }
+  
+  if (!commandPrepared[ACTION_STOP]) {
+    Serial.println("Failed to prepare command");
+  }
+  return commandPrepared[ACTION_STOP];
+}
+
+// Send an action's command based on the configured server type. detectedAt
+// is when the press was seen, or 0 to leave it out of the latency figures.
+bool sendCommand(int action, unsigned long detectedAt) {
+  ledPhasesLeft = 0;
+  digitalWrite(LED_PIN, LED_ON);
+  bool success = false;
+  unsigned long sendStart = millis();
+  sendRejected = false;
+#ifdef ESTOP_ALLOC_TRACE
+  uint32_t allocsBefore = allocCount;
+#endif
+  
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("WiFi not connected - cannot send command");
+    digitalWrite(LED_PIN, LED_OFF);
+    return false;
+  }
+  
   if (baseURL.isEmpty()) {
     Serial.println("Base URL not configured");
     digitalWrite(LED_PIN, LED_OFF);
-    return;
+    sendRejected = true;
+    return false;
   }
   
   if (gcode.isEmpty()) {
     Serial.println("Command/GCODE not configured");
     digitalWrite(LED_PIN, LED_OFF);
-    return;
+    sendRejected = true;
+    return false;
   }
   
+  // Preparation failed at boot (e.g. target offline); retry now
+  if (!commandPrepared[ACTION_STOP]) {
+    prepareCommand();
+  }
+  
+  if (!commandPrepared[action]) {
+    Serial.print("No prepared command for action: ");
+    Serial.println(actionNames[action]);
+    digitalWrite(LED_PIN, LED_OFF);
+    // With stop prepared, the server type simply has no such action
+    sendRejected = commandPrepared[ACTION_STOP];
+    return false;
+  }
+
   Serial.print("Server type: ");
   Serial.println(serverType);
   
   if (serverType.equalsIgnoreCase("kasa")) {
-    success = sendKasaCommand(gcode);
+    success = sendKasaCommand();
   } 
   else if (serverType.equalsIgnoreCase("moon") || serverType.equalsIgnoreCase("moonraker")) {
-    success = sendMoonrakerCommand(gcode);
+    success = sendMoonrakerCommand(action);
+  }
+  else if (serverType.equalsIgnoreCase("mqtt")) {
+    success = sendMqttCommand(action);
+  }
+  else if (serverType.equalsIgnoreCase("raw")) {
+    success = sendRawCommand(action);
   }
   else {
     // Default to OctoPrint
-    success = sendOctoPrintCommand(gcode);
+    success = sendOctoPrintCommand(action);
+  }
+  
+  activeMs += millis() - sendStart;
+  if (success && detectedAt != 0) {
+    ackLatencyLast = millis() - detectedAt;
+    ackLatencySum += ackLatencyLast;
+    if (ackLatencyLast > ackLatencyMax) ackLatencyMax = ackLatencyLast;
+    ackCount++;
+    Serial.print("Wake-to-ack latency: ");
+    Serial.print(ackLatencyLast);
+    Serial.println(" ms");
   }
+
+#ifdef ESTOP_ALLOC_TRACE
+  Serial.print("Press path heap allocations: ");
+  Serial.println(allocCount - allocsBefore);
+#endif
+  printHeapTelemetry();
   
-  // Blink status
+  // Blink status: quick on success, slow on error
   if (success) {
-    // Success - quick blink
-    for (int i = 0; i < 3; i++) {
-      digitalWrite(LED_PIN, LED_ON);
-      delay(100);
-      digitalWrite(LED_PIN, LED_OFF);
-      delay(100);
+    startBlink(3, 100);
+  } else {
+    startBlink(2, 500);
+  }
+  
+  return success;
+}
+
+// Start a blink of count flashes; ledTick() steps it from loop()
+void startBlink(uint8_t count, unsigned long phaseMs) {
+  ledPhasesLeft = count * 2 - 1;
+  ledPhaseMs = phaseMs;
+  ledLastToggle = millis();
+  digitalWrite(LED_PIN, LED_ON);
+}
+
+void ledTick() {
+  if (ledPhasesLeft == 0 || millis() - ledLastToggle < ledPhaseMs) return;
+  ledLastToggle = millis();
+  ledPhasesLeft--;
+  digitalWrite(LED_PIN, ledPhasesLeft % 2 ? LED_ON : LED_OFF);
+}
+
+// Simple FNV-1a over the journal, so a cold boot's random RTC contents
+// are never mistaken for pending presses
+uint32_t journalChecksum() {
+  const uint8_t* bytes = (const uint8_t*)&journal;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(PressJournal, checksum); i++) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Restore the journal after a reset, or start a fresh one
+void loadJournal() {
+  ESP.rtcUserMemoryRead(JOURNAL_RTC_OFFSET, (uint32_t*)&journal, sizeof(journal));
+  
+  if (journal.magic != JOURNAL_MAGIC || journal.checksum != journalChecksum() ||
+      journal.count > JOURNAL_SLOTS || journal.head >= JOURNAL_SLOTS) {
+    memset(&journal, 0, sizeof(journal));
+    journal.magic = JOURNAL_MAGIC;
+    journal.nextSeq = 1;
+    saveJournal();
+    return;
+  }
+  
+  // millis() restarted with the reset, so old press times mean nothing
+  for (uint8_t i = 0; i < journal.count; i++) {
+    journalEntry(i).detectedAt = 0;
+    journalEntry(i).lastTry = 0;
+  }
+  saveJournal();
+  
+  if (journal.count > 0) {
+    Serial.print("Press journal restored with ");
+    Serial.print(journal.count);
+    Serial.println(" pending presses");
+  }
+}
+
+void saveJournal() {
+  journal.checksum = journalChecksum();
+  ESP.rtcUserMemoryWrite(JOURNAL_RTC_OFFSET, (uint32_t*)&journal, sizeof(journal));
+}
+
+// The index-th pending entry, oldest first
+JournalEntry& journalEntry(uint8_t index) {
+  return journal.entries[(journal.head + index) % JOURNAL_SLOTS];
+}
+
+// Remove one pending entry, closing the gap so the rest keep their order
+void removeJournalEntry(uint8_t index) {
+  for (uint8_t i = index; i + 1 < journal.count; i++) {
+    journalEntry(i) = journalEntry(i + 1);
+  }
+  journal.count--;
+}
+
+// Record an accepted press, coalescing duplicates. loop() delivers it on the
+// same pass.
+void journalPress(uint8_t action) {
+  unsigned long now = millis();
+  unsigned long detectedAt = pressDetectedAt ? pressDetectedAt : now;
+  pressDetectedAt = 0;
+  
+  // The same action already waiting: no second entry, but the operator is
+  // pressing again, so retry it right away instead of waiting out the backoff
+  for (uint8_t i = 0; i < journal.count; i++) {
+    JournalEntry& pending = journalEntry(i);
+    if (pending.action != action) continue;
+    
+    pending.attempts = 0;
+    journal.coalesced++;
+    saveJournal();
+    Serial.print("Press coalesced into pending #");
+    Serial.println(pending.seq);
+    return;
+  }
+  
+  // Acknowledged moments ago: one delivery covers a burst of presses
+  if (lastAccepted[action] != 0 && now - lastAccepted[action] < COALESCE_MS) {
+    journal.coalesced++;
+    saveJournal();
+    Serial.print("Press coalesced: ");
+    Serial.println(actionNames[action]);
+    return;
+  }
+  
+  // Full: the oldest entry gives way
+  if (journal.count == JOURNAL_SLOTS) {
+    removeJournalEntry(0);
+    journal.lost++;
+  }
+  
+  // Presses that wait out a WiFi outage don't count toward wake-to-ack latency
+  bool online = WiFi.status() == WL_CONNECTED;
+  JournalEntry& entry = journalEntry(journal.count);
+  entry.seq = journal.nextSeq++;
+  entry.detectedAt = online ? detectedAt : 0;
+  entry.lastTry = 0;
+  entry.action = action;
+  entry.attempts = 0;
+  entry.reserved = 0;
+  journal.count++;
+  lastAccepted[action] = now ? now : 1;
+  saveJournal();
+  
+  Serial.print("Press #");
+  Serial.print(entry.seq);
+  Serial.print(" journaled: ");
+  Serial.println(actionNames[action]);
+  
+  if (!online) {
+    Serial.println("WiFi down - press will be sent on reconnect");
+  }
+}
+
+// Each entry backs off on its own after a failure: JOURNAL_RETRY_MS,
+// doubling up to 16x, so one failing action never delays another
+bool journalEntryDue(const JournalEntry& entry) {
+  if (entry.attempts == 0) return true;
+  uint8_t shift = entry.attempts - 1 < 4 ? entry.attempts - 1 : 4;
+  return millis() - entry.lastTry >= ((unsigned long)JOURNAL_RETRY_MS << shift);
+}
+
+// Make at most one delivery attempt, so loop() keeps scanning the inputs
+// between attempts: the oldest due stop first, else the oldest due entry.
+// An entry stays journaled until the target acknowledges it, and retries
+// resend the same idempotent command. Coalescing keeps at most one entry
+// per action.
+void drainJournal() {
+  if (journal.count == 0 || WiFi.status() != WL_CONNECTED) return;
+  
+  int pick = -1;
+  for (uint8_t i = 0; i < journal.count; i++) {
+    const JournalEntry& entry = journalEntry(i);
+    if (!journalEntryDue(entry)) continue;
+    if (entry.action == ACTION_STOP) {
+      pick = i;
+      break;
     }
+    if (pick < 0) pick = i;
+  }
+  if (pick < 0) return;
+  
+  JournalEntry& entry = journalEntry(pick);
+  Serial.print("Delivering press #");
+  Serial.println(entry.seq);
+  
+  if (sendCommand(entry.action, entry.detectedAt)) {
+    journal.delivered++;
+    removeJournalEntry(pick);
+  } else if (sendRejected || ++entry.attempts >= JOURNAL_MAX_ATTEMPTS) {
+    Serial.print("Press #");
+    Serial.print(entry.seq);
+    Serial.println(sendRejected ? " rejected by the target, dropped" :
+                                  " dropped after repeated failures");
+    journal.lost++;
+    lastAccepted[entry.action] = 0;
+    removeJournalEntry(pick);
   } else {
-    // Error - slow blink
-    for (int i = 0; i < 2; i++) {
-      digitalWrite(LED_PIN, LED_ON);
-      delay(500);
-      digitalWrite(LED_PIN, LED_OFF);
-      delay(500);
+    // A later success no longer measures wake-to-ack
+    entry.detectedAt = 0;
+    entry.lastTry = millis();
+  }
+  saveJournal();
+}
+
+// Run one input action; ACTION_NONE is a no-op
+void runAction(uint8_t action, const InputConfig& input) {
+  if (action == ACTION_NONE) return;
+  
+  if (action == ACTION_CONFIG) {
+    openConfigPage();
+    return;
+  }
+  
+  Serial.print(input.name);
+  Serial.print(" input - sending ");
+  Serial.println(actionNames[action]);
+  journalPress(action);
+}
+
+// True when no input is mid-debounce or held waiting for a long press
+bool inputsIdle() {
+  return (vcount0 | vcount1 | (debouncedState & ~longFired)) == 0;
+}
+
+// Build the GPI bit masks for the input table
+void initInputs() {
+  for (size_t i = 0; i < INPUT_COUNT; i++) {
+    uint8_t pin = inputs[i].pin;
+    if (pin > 15) {
+      // GPIO16 is not on the GPI register
+      Serial.print("Unsupported input pin: ");
+      Serial.println(pin);
+      continue;
     }
+    
+    pinMode(pin, INPUT_PULLUP);
+    inputMask |= (1 << pin);
+    if (inputs[i].activeLow) activeLowMask |= (1 << pin);
+    inputIndexForPin[pin] = i;
   }
+  
+  // Start from the current levels so an input already active at boot
+  // (e.g. an open door) doesn't fire until it is released and re-triggered
+  debouncedState = (GPI ^ activeLowMask) & inputMask;
+  longFired = debouncedState;
+  vcount0 = vcount1 = 0;
 }
 
-// Check for reset button hold
+// Sample every input with a single GPI read and debounce them in parallel.
+// Each bit has a 2-bit vertical counter (vcount1:vcount0) that counts samples
+// differing from the debounced state and resets when they agree; the bit
+// toggles on the 4th consecutive differing sample.
+void scanInputs() {
+  unsigned long now = millis();
+  if (now - lastScanTime < SCAN_INTERVAL_MS) return;
+  lastScanTime = now;
+  
+  uint16_t sample = (GPI ^ activeLowMask) & inputMask;
+  uint16_t delta = sample ^ debouncedState;
+  vcount1 = (vcount1 ^ vcount0) & delta;
+  vcount0 = ~vcount0 & delta;
+  uint16_t toggled = delta & ~(vcount0 | vcount1);
+  debouncedState ^= toggled;
+  
+  // Remember when an input first started changing, or when the CPU woke
+  // from light sleep for it: the wake-to-ack latency is measured from
+  // here, so it includes the wake-up and debounce time
+  if (delta == 0) {
+    activityStart = 0;
+    wakeAt = 0;
+  } else if (activityStart == 0) {
+    activityStart = wakeAt ? wakeAt : now;
+  }
+
+  // Per-input work only happens for bits that changed or are held
+  for (uint16_t bits = toggled & debouncedState; bits != 0; bits &= bits - 1) {
+    uint8_t pin = __builtin_ctz(bits);
+    uint8_t index = inputIndexForPin[pin];
+    pressStart[index] = now;
+    pressDetectedAt = activityStart ? activityStart : now;
+    longFired &= ~(1 << pin);
+    runAction(inputs[index].pressAction, inputs[index]);
+  }
+  
+  for (uint16_t bits = debouncedState & ~longFired; bits != 0; bits &= bits - 1) {
+    uint8_t pin = __builtin_ctz(bits);
+    uint8_t index = inputIndexForPin[pin];
+    if (millis() - pressStart[index] >= LONG_PRESS_MS) {
+      longFired |= (1 << pin);
+      runAction(inputs[index].longAction, inputs[index]);
+    }
+  }
+  
+  for (uint16_t bits = toggled & ~debouncedState; bits != 0; bits &= bits - 1) {
+    uint8_t pin = __builtin_ctz(bits);
+    uint8_t index = inputIndexForPin[pin];
+    if (!(longFired & (1 << pin))) {
+      runAction(inputs[index].shortAction, inputs[index]);
+    }
+    longFired &= ~(1 << pin);
+  }
+}
+
+// BUTTON_PIN went low during the idle delay. The wake-up level interrupt
+// would keep firing while the button is held, so it disarms itself, then
+// ends the delay early so the press is scanned at once.
+void IRAM_ATTR onButtonWake() {
+  GPC(BUTTON_PIN) &= ~((0xF << GPCI) | (1 << GPCWE));
+  if (wakeAt == 0) wakeAt = millis();
+  esp_schedule();
+}
+
+// Battery profile: idle in delay() so the SDK light-sleeps between beacons
+// while staying associated. A press on the stop button wakes the CPU and
+// ends the delay; the other inputs are sampled every BATTERY_POLL_MS.
+void batterySleep() {
+  // A latched or held stop button would wake us straight back up
+  bool armWake = digitalRead(BUTTON_PIN) == HIGH;
+  if (armWake) {
+    wakeAt = 0;
+    attachInterrupt(BUTTON_PIN, onButtonWake, ONLOW);
+    gpio_pin_wakeup_enable(GPIO_ID_PIN(BUTTON_PIN), GPIO_PIN_INTR_LOLEVEL);
+  }
+  
+  unsigned long start = millis();
+  delay(BATTERY_POLL_MS);
+  sleepMs += millis() - start;
+  
+  if (armWake) {
+    gpio_pin_wakeup_disable();
+    detachInterrupt(BUTTON_PIN);
+  }
+  
+  // Scan straight away, timing a press from the wake-up
+  if (wakeAt != 0) {
+    lastScanTime = millis() - SCAN_INTERVAL_MS;
+  }
+}
+
+// Check for a button hold at boot: released after LONG_PRESS_MS opens the
+// config page once connected, held for RESET_HOLD_MS clears the settings.
+// The inputs aren't armed yet, so neither sends a command.
 void checkReset() {
   unsigned long holdStart = millis();
+  unsigned long elapsed = 0;
   while (digitalRead(BUTTON_PIN) == LOW) {
-    unsigned long elapsed = millis() - holdStart;
+    elapsed = millis() - holdStart;
     digitalWrite(LED_PIN, (elapsed / 100) % 2 == 0 ? LED_ON : LED_OFF);
     if (elapsed >= RESET_HOLD_MS) {
       Serial.println("Long press detected. Clearing EEPROM and rebooting...");
@@ -716,6 +2096,11 @@ void checkReset() {
     delay(10);
   }
   digitalWrite(LED_PIN, LED_OFF);
+  
+  if (elapsed >= LONG_PRESS_MS) {
+    Serial.println("Boot hold detected. Config page will open once connected");
+    configRequested = true;
+  }
 }
 
 void setup() {
@@ -735,70 +2120,48 @@ void setup() {
   // Check for reset button press during boot
   checkReset();
   
-  // Configure WiFi using WiFiManager
-  WiFiManager wm;
-  WiFiManagerParameter param_url("octourl", "Base URL or Kasa IP", "", 200);
-  WiFiManagerParameter param_key("apikey", "API Key (or unused for Kasa)", "", 100);
-  WiFiManagerParameter param_gcode("gcode", "GCODE or Kasa Action (on/off/on0/off1)", "M112", 100);
-  WiFiManagerParameter param_type("type", "Server Type (octo/moon/kasa)", "octo", 20);
+  // Presses accepted before a watchdog reset are still pending here
+  loadJournal();
+  
+  // Keep mode and sleep changes out of flash; WiFiManager still saves new
+  // credentials itself
+  WiFi.persistent(false);
   
+  // Configure WiFi using WiFiManager
   wm.addParameter(&param_url);
   wm.addParameter(&param_key);
   wm.addParameter(&param_gcode);
   wm.addParameter(&param_type);
-  
+  wm.addParameter(&param_profile);
+
   // Load saved parameters
   loadConfig();
   
-  // Set parameter defaults from loaded config if available
-  if (!baseURL.isEmpty()) {
-    param_url.setValue(baseURL.c_str(), 200);
-  }
-  if (!apiKey.isEmpty()) {
-    param_key.setValue(apiKey.c_str(), 100);
-  }
-  if (!gcode.isEmpty()) {
-    param_gcode.setValue(gcode.c_str(), 100);
-  }
-  if (!serverType.isEmpty()) {
-    param_type.setValue(serverType.c_str(), 20);
+  // Set parameter defaults from loaded config (never the stored key)
+  refreshConfigParams();
+
+  // Save parameters callback (captive portal and on-demand config page)
+  wm.setSaveParamsCallback(applyConfig);
+  
+  // With saved credentials, don't let a router that is still booting (e.g.
+  // after a power cut) strand the button in AP mode: close the portal and
+  // go back to retrying the saved network
+  if (wm.getWiFiIsSaved()) {
+    wm.setConfigPortalTimeout(CONFIG_PORTAL_TIMEOUT_S);
   }
   
-  // Save parameters callback
-  wm.setSaveParamsCallback([&]() {
-    Serial.println("WiFiManager params saved");
-    saveConfig(
-      param_url.getValue(),
-      param_key.getValue(),
-      param_gcode.getValue(),
-      param_type.getValue()
-    );
-  });
-  
-  // Start WiFi configuration portal if needed
-  if (!wm.autoConnect("EstopConfigAP")) {
-    Serial.println("WiFiManager failed. Rebooting...");
-    delay(3000);
-    ESP.restart();
-  }
-  
-  // Save parameters if they were updated during autoConnect
-  if (String(param_url.getValue()).length() > 0) {
-    saveConfig(
-      param_url.getValue(),
-      param_key.getValue(),
-      param_gcode.getValue(),
-      param_type.getValue()
-    );
-    
-    // Reload the configuration
-    loadConfig();
+  // Start WiFi configuration portal if needed, without blocking: loop()
+  // services it with wm.process() while the inputs are already armed
+  wm.setConfigPortalBlocking(false);
+  if (wm.autoConnect("EstopConfigAP")) {
+    wifiWasConnected = true;
+    Serial.println("WiFi connected");
+    Serial.print("IP address: ");
+    Serial.println(WiFi.localIP());
+  } else {
+    Serial.println("Config portal running on EstopConfigAP");
   }
   
-  Serial.println("WiFi connected");
-  Serial.print("IP address: ");
-  Serial.println(WiFi.localIP());
-  
   // Quick blink to indicate ready state
   for (int i = 0; i < 3; i++) {
     digitalWrite(LED_PIN, LED_ON);
@@ -807,39 +2170,74 @@ void setup() {
     delay(50);
   }
   
-  // If we're in Kasa mode, query the device info once at startup
-  if (serverType.equalsIgnoreCase("kasa") && !baseURL.isEmpty()) {
-    String deviceId;
-    String childIds[8];
-    int numChildren;
-    getKasaDeviceInfo(baseURL, deviceId, childIds, numChildren);
+  // Build the press payloads once (queries Kasa device info in Kasa mode)
+  applyPowerProfile();
+  if (wifiWasConnected) {
+    prepareCommand();
   }
+  initInputs();
+  printHeapTelemetry();
+  lastTelemetryTime = millis();
 }
 
 void loop() {
-  // Read button state with debounce
-  bool reading = digitalRead(BUTTON_PIN);
+  // Scan and debounce all inputs, then make at most one delivery attempt
+  // for whatever is journaled
+  scanInputs();
+  drainJournal();
+  ledTick();
+  wm.process();
+  keepWarm();
+  mqttTick();
+  kasaDiscoveryTick();
+
+  pollSerialCommand();
   
-  if (reading != lastButtonState) {
-    lastDebounceTime = millis();
+  // Open the config page requested at boot or on the console, and close it
+  // again after a save or once it times out
+  if (configRequested && WiFi.status() == WL_CONNECTED) {
+    configRequested = false;
+    openConfigPage();
   }
-  
-  if ((millis() - lastDebounceTime) > DEBOUNCE_MS) {
-    if (reading == LOW && !buttonPressed) {
-      buttonPressed = true;
-      Serial.println("Button pressed - sending command");
-      sendCommand();
-    } else if (reading == HIGH) {
-      buttonPressed = false;
+  if (wm.getWebPortalActive() &&
+      (configSaved || millis() - configPageOpenedAt >= CONFIG_PAGE_TIMEOUT_MS)) {
+    closeConfigPage();
+  }
+
+  // Periodic heap telemetry
+  if (millis() - lastTelemetryTime >= TELEMETRY_INTERVAL_MS) {
+    lastTelemetryTime = millis();
+    printHeapTelemetry();
+  }
+
+  // Connected (again), possibly after the config portal: make sure the
+  // payload is ready before the next press
+  if (WiFi.status() == WL_CONNECTED && !wifiWasConnected) {
+    wifiWasConnected = true;
+    Serial.print("WiFi connected, IP address: ");
+    Serial.println(WiFi.localIP());
+    if (!commandPrepared[ACTION_STOP]) {
+      prepareCommand();
     }
   }
   
-  lastButtonState = reading;
+  // Handle WiFi reconnection if needed (the config portal manages WiFi itself),
+  // without blocking the loop so the inputs stay live
+  if (WiFi.status() != WL_CONNECTED && !wm.getConfigPortalActive()) {
+    if (wifiWasConnected) {
+      wifiWasConnected = false;
+      Serial.println("WiFi connection lost. Reconnecting...");
+    }
+    if (millis() - lastReconnectAttempt >= RECONNECT_INTERVAL_MS) {
+      lastReconnectAttempt = millis();
+      WiFi.reconnect();
+    }
+  }
   
-  // Handle WiFi reconnection if needed
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("WiFi connection lost. Reconnecting...");
-    WiFi.reconnect();
-    delay(5000);
+  // Battery profile: sleep whenever nothing is pending, but stay awake
+  // while any input is changing or held
+  if (powerProfile == PROFILE_BATTERY && inputsIdle() && journal.count == 0 && ledPhasesLeft == 0 &&
+      !wm.getConfigPortalActive() && !wm.getWebPortalActive()) {
+    batterySleep();
   }
-}
\ No newline at end of file
+}